@@ -1,41 +1,126 @@
 #ifndef RANDOMJSON_H
 #define RANDOMJSON_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
+#include <condition_variable>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
 #include <random>
-#include <stack>
 #include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace randomjson {
 
 class RandomEngine {
     public:
-    void seed(int new_seed) {
+    // The engine is counter-based: the n-th draw only depends on the seed, the stream and n.
+    // Streams are independent sequences sharing the same seed. Stream 0 is the default one.
+    void seed(uint64_t new_seed, uint64_t stream = 0) {
         seed_ = new_seed;
+        stream_ = stream;
+        increment_ = (stream == 0) ? UINT64_C(0x60bee2bee120fc15) : (mix(stream) | 1);
+        // Newton's iterations give the inverse of the (odd) increment modulo 2^64
+        inverse_increment_ = increment_;
+        for (int i = 0; i < 5; i++) {
+            inverse_increment_ *= 2 - increment_ * inverse_increment_;
+        }
         wyhash64_x_ = new_seed;
+        bits_left_ = 0;
     };
     uint64_t next() {
         // Adaptated from https://github.com/wangyi-fudan/wyhash/blob/master/wyhash.h
         // Inspired from https://github.com/lemire/testingRNG/blob/master/source/wyhash.h
-        wyhash64_x_ += UINT64_C(0x60bee2bee120fc15);
-        __uint128_t tmp;
-        tmp = (__uint128_t) wyhash64_x_ * UINT64_C(0xa3b195354a39b70d);
-        uint64_t m1 = (tmp >> 64) ^ tmp;
-        tmp = (__uint128_t) m1 * UINT64_C(0x1b03738712fad5c9);
-        uint64_t m2 = (tmp >> 64) ^ tmp;
-        return m2;
+        wyhash64_x_ += increment_;
+        return mix(wyhash64_x_);
+    }
+    // Writes the next n draws. Same as calling next() n times.
+    void fill(uint64_t* out, size_t n) {
+        compute_block(wyhash64_x_, out, n);
+        wyhash64_x_ += n * increment_;
+    }
+    // Skips the next n draws in O(1). The bits left in the reservoir are dropped.
+    void skip(uint64_t n) {
+        wyhash64_x_ += n * increment_;
+        bits_left_ = 0;
     }
-    bool next_bool() { return (next() & 1) == 1; }
+    // Jumps to the state following n draws since the seed, in O(1). The bits left in the reservoir are dropped.
+    void seek(uint64_t n) {
+        wyhash64_x_ = seed_ + n * increment_;
+        bits_left_ = 0;
+    }
+    // Number of draws since the seed
+    uint64_t position() { return (wyhash64_x_ - seed_) * inverse_increment_; }
+    uint64_t get_seed() { return seed_; }
+    uint64_t get_stream() { return stream_; }
+    // Returns the next n bits (1 <= n <= 32). The bits come from a reservoir refilled with full draws,
+    // so small choices don't burn a whole draw. Bits that are left when a choice needs more are dropped.
+    uint64_t next_bits(int n) {
+        if (n > bits_left_) {
+            bits_ = next();
+            bits_left_ = 64;
+        }
+        uint64_t bits = bits_ & ((UINT64_C(1) << n) - 1);
+        bits_ >>= n;
+        bits_left_ -= n;
+        return bits;
+    }
+    bool next_bool() { return next_bits(1) == 1; }
     int next_int() { return static_cast<int>(next()); }
-    char next_char() { return static_cast<char>(next()); }
+    char next_char() { return static_cast<char>(next_bits(8)); }
     double next_double() { return static_cast<double>(next()); }
     int next_ranged_int(int min, int max) { // min and max are include
-        // Adapted from https://lemire.me/blog/2019/06/06/nearly-divisionless-random-integer-generation-on-various-systems/
-       /*  if (min == max) {
-            return min;
-       }*/
         int s = max-min+1;
+        if (s <= 1) {
+            return min;
+        }
+        // Small ranges are drawn from the reservoir: just enough bits, rejected when out of range.
+        // It is unbiased, and it never takes more than twice the bits on average.
+        if (s <= (1 << 16)) {
+            int width = 32 - __builtin_clz(static_cast<uint32_t>(s-1));
+            uint64_t x;
+            do {
+                x = next_bits(width);
+            } while (x >= static_cast<uint64_t>(s));
+            return static_cast<int>(x) + min;
+        }
+        // Adapted from https://lemire.me/blog/2019/06/06/nearly-divisionless-random-integer-generation-on-various-systems/
+        uint64_t x = next();
+        __uint128_t m = (__uint128_t) x * (__uint128_t) s;
+        uint64_t l = (uint64_t) m;
+        if (l < static_cast<uint64_t>(s)) {
+            uint64_t t = -static_cast<uint64_t>(s) % s;
+            while (l < t) {
+                x = next();
+                m = (__uint128_t) x * (__uint128_t) s;
+                l = (uint64_t) m;
+            }
+        }
+        return (m >> 64) + min;
+    }
+    int64_t next_ranged_int64(int64_t min, int64_t max) { // min and max are include
+        uint64_t s = static_cast<uint64_t>(max-min)+1;
         uint64_t x = next();
         __uint128_t m = (__uint128_t) x * (__uint128_t) s;
         uint64_t l = (uint64_t) m;
@@ -47,59 +132,342 @@ class RandomEngine {
                 l = (uint64_t) m;
             }
         }
-        return (m >> 64) + min;
+        return static_cast<int64_t>(m >> 64) + min;
+    }
+
+    private:
+    // Computes the n draws following the counter x.
+    // Every draw only depends on its own counter, so there is no dependency chain between them.
+    // SIMD does not help there, since neither AVX2 nor AVX-512F can do a 64x64->128 bits multiplication.
+    // However, four independent lanes keep the multipliers of the CPU busy.
+    void compute_block(uint64_t x, uint64_t* out, size_t n) {
+        const uint64_t increment = increment_;
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            out[i] = mix(x + (i+1) * increment);
+            out[i+1] = mix(x + (i+2) * increment);
+            out[i+2] = mix(x + (i+3) * increment);
+            out[i+3] = mix(x + (i+4) * increment);
+        }
+        for (; i < n; i++) {
+            out[i] = mix(x + (i+1) * increment);
+        }
+    }
+
+    static uint64_t mix(uint64_t x) {
+        __uint128_t tmp;
+        tmp = (__uint128_t) x * UINT64_C(0xa3b195354a39b70d);
+        uint64_t m1 = (tmp >> 64) ^ tmp;
+        tmp = (__uint128_t) m1 * UINT64_C(0x1b03738712fad5c9);
+        uint64_t m2 = (tmp >> 64) ^ tmp;
+        return m2;
+    }
+
+    uint64_t seed_ = 0;
+    uint64_t stream_ = 0;
+    uint64_t increment_ = UINT64_C(0x60bee2bee120fc15);
+    uint64_t inverse_increment_ = 0;
+    uint64_t wyhash64_x_ = 0;
+
+    // bit reservoir
+    uint64_t bits_ = 0;
+    int bits_left_ = 0;
+};
+
+// 64 bits of true randomness, to use as a seed
+uint64_t random_seed()
+{
+    std::random_device device;
+    return (static_cast<uint64_t>(device()) << 32) | device();
+}
+
+// Non-ascii code points are drawn from these ranges. Together, they cover every plane, except the surrogates.
+enum UnicodeRange {
+    unicode_latin1, // U+0080 to U+00FF
+    unicode_latin_extended, // U+0100 to U+036F, with IPA and combining marks
+    unicode_greek_cyrillic, // U+0370 to U+052F
+    unicode_other_two_bytes, // U+0530 to U+07FF: armenian, hebrew, arabic, syriac...
+    unicode_other_three_bytes, // U+0800 to U+2FFF: indic scripts, thai, punctuation, symbols...
+    unicode_cjk_symbols, // U+3000 to U+4DBF: cjk punctuation, kana, cjk extension A
+    unicode_cjk, // U+4E00 to U+9FFF: cjk unified ideographs
+    unicode_yi, // U+A000 to U+ABFF
+    unicode_hangul, // U+AC00 to U+D7FF
+    unicode_private_use, // U+E000 to U+FFFF: private use area, compatibility forms, specials
+    unicode_supplementary_multilingual, // U+10000 to U+1FFFF: historic scripts, emojis...
+    unicode_supplementary_ideographic, // U+20000 to U+3FFFF
+    unicode_other_planes, // U+40000 to U+10FFFF
+    number_of_unicode_ranges
+};
+
+const uint32_t unicode_ranges[number_of_unicode_ranges][2] = {
+    {0x80, 0xff},
+    {0x100, 0x36f},
+    {0x370, 0x52f},
+    {0x530, 0x7ff},
+    {0x800, 0x2fff},
+    {0x3000, 0x4dbf},
+    {0x4e00, 0x9fff},
+    {0xa000, 0xabff},
+    {0xac00, 0xd7ff},
+    {0xe000, 0xffff},
+    {0x10000, 0x1ffff},
+    {0x20000, 0x3ffff},
+    {0x40000, 0x10ffff}
+};
+
+typedef std::array<int, number_of_unicode_ranges> UnicodeWeights;
+
+// Draws non-ascii code points with one random draw each.
+// The 32 high bits of the draw choose a range according to its weight, the 32 low bits choose the code point in it.
+class CodepointSampler {
+    public:
+    void load(const UnicodeWeights& weights) {
+        uint64_t total = 0;
+        for (int weight : weights) {
+            total += std::max(weight, 0);
+        }
+        uint64_t cumulated = 0;
+        for (int i = 0; i < number_of_unicode_ranges; i++) {
+            cumulated += std::max(weights[i], 0);
+            thresholds[i] = (total == 0) ? 0 : (cumulated << 32) / total;
+        }
+        empty_ = (total == 0);
+    }
+    // true if every weight is 0. Then, no code point can be drawn.
+    bool empty() const { return empty_; }
+    uint32_t next(RandomEngine& random_generator) const {
+        uint64_t random_bits = random_generator.next();
+        uint64_t range_bits = random_bits >> 32;
+        int range = 0;
+        while (range < number_of_unicode_ranges-1 && range_bits >= thresholds[range]) {
+            range++;
+        }
+        uint64_t range_size = unicode_ranges[range][1] - unicode_ranges[range][0] + 1;
+        return unicode_ranges[range][0] + static_cast<uint32_t>(((random_bits & 0xffffffff) * range_size) >> 32);
+    }
+
+    private:
+    uint64_t thresholds[number_of_unicode_ranges];
+    bool empty_ = true;
+};
+
+// Draws one of a few outcomes according to their weights in constant time (Walker's alias method).
+// The outcomes are padded to a power of two of columns. A column gives its outcome with the probability of its threshold
+// (out of 2^16), and its alias otherwise. A full or an empty column costs a single draw of a few bits,
+// so weights that split evenly among the columns cost no more than a switch on next_bits().
+class AliasTable {
+    public:
+    static const int max_outcomes = 16;
+    // Negative weights count as 0, and every weight 0 is the same as every weight 1.
+    void load(const float* weights, int number_of_outcomes) {
+        bits = 0;
+        while ((1 << bits) < number_of_outcomes) {
+            bits++;
+        }
+        const int columns = 1 << bits;
+        double total = 0;
+        for (int i = 0; i < number_of_outcomes; i++) {
+            total += std::max(weights[i], 0.0f);
+        }
+        // Probabilities in 2^16ths of a column. The rounding error goes to the biggest one, so they fill every column.
+        int64_t scaled[max_outcomes] = {0};
+        int64_t sum = 0;
+        int biggest = 0;
+        for (int i = 0; i < columns; i++) {
+            const double weight = (i >= number_of_outcomes) ? 0 : (total == 0) ? 1 : std::max(weights[i], 0.0f);
+            scaled[i] = static_cast<int64_t>(weight * columns * full / (total == 0 ? number_of_outcomes : total) + 0.5);
+            sum += scaled[i];
+            biggest = (scaled[i] > scaled[biggest]) ? i : biggest;
+            aliases[i] = static_cast<uint8_t>(i);
+        }
+        scaled[biggest] += int64_t(columns) * full - sum;
+        if (scaled[biggest] == int64_t(columns) * full) {
+            // A single possible outcome, drawn without a single bit
+            bits = 0;
+            thresholds[0] = 0;
+            aliases[0] = static_cast<uint8_t>(biggest);
+            return;
+        }
+        // The columns under a full one are topped up by the columns over it
+        int small[max_outcomes];
+        int large[max_outcomes];
+        int smalls = 0;
+        int larges = 0;
+        for (int i = 0; i < columns; i++) {
+            thresholds[i] = full;
+            if (scaled[i] < full) {
+                small[smalls++] = i;
+            }
+            else if (scaled[i] > full) {
+                large[larges++] = i;
+            }
+        }
+        while (smalls > 0 && larges > 0) {
+            const int column = small[--smalls];
+            const int donor = large[--larges];
+            thresholds[column] = static_cast<uint32_t>(scaled[column]);
+            aliases[column] = static_cast<uint8_t>(donor);
+            scaled[donor] -= full - scaled[column];
+            if (scaled[donor] < full) {
+                small[smalls++] = donor;
+            }
+            else if (scaled[donor] > full) {
+                large[larges++] = donor;
+            }
+        }
+    }
+    // Two outcomes, 1 with the given probability (from 0 to 1) and 0 otherwise
+    void load_probability(float probability) {
+        const float weights[2] = {1 - probability, probability};
+        load(weights, 2);
+    }
+    int next(RandomEngine& random_generator) const {
+        const int column = (bits == 0) ? 0 : static_cast<int>(random_generator.next_bits(bits));
+        const uint32_t threshold = thresholds[column];
+        if (threshold == full || (threshold != 0 && random_generator.next_bits(16) < threshold)) {
+            return column;
+        }
+        return aliases[column];
     }
 
     private:
-    uint64_t seed_;
-    uint64_t wyhash64_x_;
+    static const uint32_t full = 1 << 16;
+    int bits = 0;
+    uint32_t thresholds[max_outcomes] = {full};
+    uint8_t aliases[max_outcomes] = {0};
+};
+
+// Shapes of documents, each stressing a stage of a parser
+enum Workload {
+    mixed_workload, // every kind of value
+    float_heavy_workload, // number parsing
+    integer_heavy_workload, // number parsing
+    long_string_workload, // string validation and copy
+    escape_heavy_workload, // string unescaping, with many escaped surrogate pairs
+    whitespace_heavy_workload, // structural indexing
+    deep_nesting_workload, // depth tracking
+    wide_flat_array_workload // a single array of scalars
 };
 
+// Kinds of mutations applied by RandomJson::mutate()
+enum MutationType {
+    byte_mutation, // a random byte takes a random value
+    value_mutation, // a value is replaced by another valid value of the same size (see StructuralIndex)
+    // The token mutations target the positions of a TokenTable. They make invalid documents of the same size.
+    drop_comma, // a comma becomes a space
+    duplicate_comma, // a whitespace next to a comma becomes a comma
+    swap_brackets, // a bracket becomes the other kind of bracket ('[' and '{', ']' and '}')
+    cut_string, // a string is closed before its end, possibly in the middle of an escape or a character
+    control_character, // a byte of a string becomes a control character
+    broken_surrogate, // the second half of an escaped surrogate pair is replaced, the first one is left alone
+    extra_exponent_sign, // the exponent of a number gets two signs in a row
+    number_of_mutation_types
+};
+
+typedef std::array<int, number_of_mutation_types> MutationWeights;
+
+struct JsonProfile;
+
 struct Settings {
     // If filepath is different than an empty string, RandomJson will load from the corresponding file.
     // That means the json document won't be randomly generated.
     // That implies the generation_seed won't be used and the size will be adjusted to the file's size.
     // The other options will be used for the mutations, but they will not correspond to the original document.
     std::string filepath;
-    int size = 0;
-    int generation_seed = std::random_device{}();
-    int mutation_seed = std::random_device{}();
+    // If output_filepath is different than an empty string, the document is generated straight into that file,
+    // through a shared memory mapping. Nothing is copied between the generation and the file, and save() is not needed.
+    // When the file can't be mapped, the document is saved in it. Either way, the file holds the document
+    // with its number_of_mutations mutations. After later mutations, save(output_filepath) updates it.
+    std::string output_filepath;
+    int64_t size = 0;
+    uint64_t generation_seed = random_seed();
+    uint64_t mutation_seed = random_seed();
     int number_of_mutations = 0;
-    std::vector<int> skipped_mutations; // we want to skip mutations that causes errors
+    // Mutations that are not applied on creation (their numbers, from 0). The random draws of each mutation only depend on
+    // its number (it seeks to number << 32), so a byte mutation is the same with or without the ones skipped before it.
+    // A value or token mutation draws among the values or tokens of the document as it is, so it may change.
+    std::vector<int> skipped_mutations;
+    // Weight of each MutationType. Value mutations need the structural index, which is then always recorded.
+    MutationWeights mutation_weights = {{1, 0, 0, 0, 0, 0, 0, 0, 0}};
     bool bom = false;
     int max_number_range = 308; // Numbers will be smaller than 10^range
-    int max_number_size; // in bytes and in length
+    int max_number_size = 32; // in bytes and in length
     int max_string_size = 2048; // in bytes
     int max_whitespace_size = 24; // in bytes and in length
+    // Weight of each UnicodeRange among the non-ascii characters of the strings. All 0 means ascii only.
+    UnicodeWeights unicode_weights = {{4, 3, 3, 3, 2, 1, 3, 1, 1, 1, 2, 1, 1}};
     int max_depth = 1024;
-    // These are other option ideas that are not currently implemented.
-    /*float chances_have_BOM = 0;
-    float chances_over_max_number_range = 0;
-    float chances_over_max_number_size = 0;
-    float chances_over_max_string_size = 0;
-    float chances_over_max_whitespace_size = 0;
-    float chances_over_max_depth = 0;
-    float chances_invalid_comma = 0;
-    float chances_invalid_utf8 = 0;
-    float chances_invalid_string = 0;
-    float chances_invalid_codepoint = 0;
-    float chances_invalid_number = 0;
-    float chances_generating_number = 0;
-    float chances_generating_string = 0;
-    float chances_generating_object = 0;
-    float chances_generating_array = 0;
-    float chances_generating_null = 0;
-    float chances_generating_false = 0;
-    float chances_generating_true = 0;*/
+    // The document starts at a multiple of alignment (a power of two) and it is followed by padding zeroed bytes,
+    // so it can be given to a SIMD parser without a copy (simdjson needs SIMDJSON_PADDING bytes, for instance).
+    // The alignment is not enforced on a buffer given by the caller.
+    size_t alignment = 64;
+    size_t padding = 0;
+    // Shape of the document (see workload_settings())
+    Workload workload = mixed_workload;
+    // Records a StructuralIndex of the document while it is generated in memory (see get_structural_index()).
+    bool structural_index = false;
+    // When different than 0, the top-level container is split in independent subtrees of about this size (in bytes).
+    // Each subtree has its own random generator, so they can be generated by several threads.
+    // The document only depends on the seed and on this size, not on the number of threads.
+    int64_t subtree_size = 0;
+    unsigned int threads = 1; // threads generating the subtrees (or the records). 0 uses every core.
+    // Generates newline-delimited documents (NDJSON, or JSON Lines) instead of a single document, size bytes in all.
+    // Each record takes about min_record_size to max_record_size bytes, and it is followed by a newline.
+    // The whitespaces of the records are spaces and tabs. stray_lines adds empty or blank lines between records.
+    // Each record has its own random generator, so they can be generated by several threads. subtree_size is ignored.
+    bool ndjson = false;
+    int64_t min_record_size = 64;
+    int64_t max_record_size = 4096;
+    bool stray_lines = false;
+    // A streamed NDJSON document only keeps its record offsets and sizes (see get_record_offsets()) with this flag,
+    // since they grow with the number of records.
+    bool stream_record_offsets = false;
+    // Weights of the kinds of values (only their ratios matter). Every weight 0 is the same as every weight 1.
+    // The top-level container is an object or an array according to their weights, and an array if both are 0.
+    // The weights are compiled in alias tables when the settings are loaded, so each choice costs one small draw.
+    float chances_generating_object = 3;
+    float chances_generating_array = 3;
+    float chances_generating_string = 6;
+    float chances_generating_number = 6;
+    float chances_generating_true = 2;
+    float chances_generating_false = 2;
+    float chances_generating_null = 2;
+    // Weights of the kinds of numbers. A float that doesn't fit is replaced by an integer.
+    float chances_generating_integer = 1;
+    float chances_generating_float = 1;
+    // When set, the generation follows the statistics of sample documents instead: the values of each depth,
+    // the lengths of the strings and of the whitespaces, the digits of the integers, the keys and the widths
+    // of the containers. The chances of the values and of the numbers are then ignored.
+    std::shared_ptr<const JsonProfile> profile;
+    // Probabilities (from 0 to 1) of going over a limit or of writing an invalid piece, for testing the limits
+    // and the errors of a parser. They are compiled in alias tables too, and a probability of 0 costs no draw.
+    float chances_have_BOM = 0; // the document starts with a BOM (it always does when bom is set)
+    float chances_over_max_number_range = 0; // the exponent of a float goes over max_number_range
+    float chances_over_max_number_size = 0; // a number is an integer of more than max_number_size digits
+    float chances_over_max_string_size = 0; // a string is longer than max_string_size, if its entry has room
+    float chances_over_max_whitespace_size = 0; // a whitespace is longer than max_whitespace_size
+    float chances_over_max_depth = 0; // a container is opened at max_depth anyway
+    float chances_invalid_comma = 0; // an entry misses its comma, or the first entry of a container has one
+    float chances_invalid_utf8 = 0; // a string starts with a byte sequence that isn't UTF-8
+    float chances_invalid_string = 0; // a string starts with a control character or an unknown escape
+    float chances_invalid_codepoint = 0; // a string starts with an unpaired surrogate or a bad hexadecimal escape
+    float chances_invalid_number = 0; // a number is malformed (a leading zero, a dot or an exponent without digits...)
 
     Settings() {}
 
-    Settings(int size)
+    Settings(int64_t size)
+    : size(size)
+    {}
+
+    Settings(int64_t size, uint64_t mutation_seed)
     : size(size)
+    , mutation_seed(mutation_seed)
     {}
 
-    Settings(int size, int mutation_seed)
+    // Doesn't ask std::random_device for seeds, which is slow
+    Settings(int64_t size, uint64_t generation_seed, uint64_t mutation_seed)
     : size(size)
+    , generation_seed(generation_seed)
     , mutation_seed(mutation_seed)
     {}
 
@@ -108,48 +476,773 @@ struct Settings {
     {}
 };
 
+// Sets the weights of the kinds of values. true, false and null share the weight of the literals.
+void set_value_chances(Settings& settings, float object, float array, float string, float number, float literal)
+{
+    settings.chances_generating_object = object;
+    settings.chances_generating_array = array;
+    settings.chances_generating_string = string;
+    settings.chances_generating_number = number;
+    settings.chances_generating_true = literal / 3;
+    settings.chances_generating_false = literal / 3;
+    settings.chances_generating_null = literal / 3;
+}
+
+// Settings of a preset workload: the workload itself, the chances of the values and the limits that suit it
+Settings workload_settings(Workload workload, int64_t size)
+{
+    Settings settings(size);
+    settings.workload = workload;
+    switch (workload) {
+    case float_heavy_workload:
+    case integer_heavy_workload:
+        // Arrays of numbers
+        set_value_chances(settings, 0, 1, 0, 15, 0);
+        settings.chances_generating_integer = (workload == integer_heavy_workload) ? 1 : 0;
+        settings.chances_generating_float = (workload == float_heavy_workload) ? 1 : 0;
+        break;
+    case long_string_workload:
+        // Arrays of strings: a long key would leave no room for its value
+        set_value_chances(settings, 0, 1, 15, 0, 0);
+        settings.max_string_size = 1 << 16;
+        break;
+    case escape_heavy_workload:
+        set_value_chances(settings, 1, 1, 30, 0, 0);
+        break;
+    case whitespace_heavy_workload:
+        settings.max_whitespace_size = 256;
+        break;
+    case deep_nesting_workload:
+        set_value_chances(settings, 9, 9, 3, 3, 3);
+        break;
+    case wide_flat_array_workload:
+        // A single array of scalars
+        set_value_chances(settings, 0, 0, 3, 3, 3);
+        break;
+    default:
+        break;
+    }
+    return settings;
+}
+
+// Types of the entries of a structural index
+enum StructuralType {
+    structural_object,
+    structural_array,
+    structural_key,
+    structural_string,
+    structural_number,
+    structural_true,
+    structural_false,
+    structural_null
+};
+
+// Compact structural index of a generated document, recorded during its generation.
+// Like simdjson's tape, there is an entry for every container, key and value, in the document's order,
+// but each field has its own array (structure of arrays).
+// The length of a container goes up to its closing bracket, and its content follows its entry.
+// The depth of the top-level container is 0.
+struct StructuralIndex {
+    std::vector<int64_t> offsets;
+    std::vector<int64_t> lengths;
+    std::vector<uint8_t> types; // StructuralType
+    std::vector<uint32_t> depths;
+
+    size_t size() const { return offsets.size(); }
+    void clear() {
+        offsets.clear();
+        lengths.clear();
+        types.clear();
+        depths.clear();
+        open_entries.clear();
+    }
+    void add(int64_t offset, int64_t length, StructuralType type, uint32_t depth) {
+        offsets.push_back(offset);
+        lengths.push_back(length);
+        types.push_back(type);
+        depths.push_back(depth);
+    }
+    // Adds a container. Its length is known once it is closed.
+    void open(int64_t offset, StructuralType type, uint32_t depth) {
+        open_entries.push_back(size());
+        add(offset, 0, type, depth);
+    }
+    // Closes the last open container. end is the offset following its closing bracket.
+    void close(int64_t end) {
+        size_t entry = open_entries.back();
+        open_entries.pop_back();
+        lengths[entry] = end - offsets[entry];
+    }
+    // Forgets the entries added after the first size ones
+    void truncate(size_t size) {
+        offsets.resize(size);
+        lengths.resize(size);
+        types.resize(size);
+        depths.resize(size);
+    }
+    // Adds the entries of another index, deeper by extra_depth
+    void append(const StructuralIndex& other, uint32_t extra_depth) {
+        offsets.insert(offsets.end(), other.offsets.begin(), other.offsets.end());
+        lengths.insert(lengths.end(), other.lengths.begin(), other.lengths.end());
+        types.insert(types.end(), other.types.begin(), other.types.end());
+        for (uint32_t depth : other.depths) {
+            depths.push_back(depth + extra_depth);
+        }
+    }
+
+    private:
+    std::vector<size_t> open_entries;
+};
+
+// Statistics of sample documents, which the generation can follow instead of uniform choices (see Settings::profile).
+// The lengths are counted in buckets of powers of two: 0, 1, 2 to 3, 4 to 7... up to the last bucket.
+struct JsonProfile {
+    static const int max_depth = 16; // deeper values are counted with the values of the last depth
+    static const int number_of_buckets = 16;
+    static const size_t max_saved_keys = 1024; // the most frequent keys
+    typedef std::array<uint64_t, number_of_buckets> Histogram;
+
+    // Values of each depth (the top-level container is at depth 0), by StructuralType. The keys are counted too.
+    std::vector<std::array<uint64_t, structural_null+1> > values;
+    Histogram string_lengths = Histogram(); // in bytes, between the quotes
+    Histogram whitespace_lengths = Histogram(); // before each token
+    Histogram integer_digits = Histogram();
+    uint64_t integers = 0;
+    uint64_t floats = 0;
+    uint64_t negative_integers = 0;
+    uint64_t arrays = 0;
+    uint64_t array_entries = 0;
+    uint64_t objects = 0;
+    uint64_t object_entries = 0;
+    uint64_t keys = 0;
+    std::unordered_map<std::string, uint64_t> key_counts; // as written in the documents, escapes included
+    // Changed by add() and load(), to a number that no other profile has. The generators keep the keys of a profile
+    // sorted by frequency until its generation changes, so a profile changed otherwise should have a generation of 0.
+    uint64_t generation = 0;
+    static uint64_t next_generation() {
+        static std::atomic<uint64_t> last_generation(0);
+        return ++last_generation;
+    }
+
+    static int bucket(uint64_t length) {
+        int bucket = 0;
+        while (length != 0 && bucket < number_of_buckets-1) {
+            length >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+    static int64_t bucket_min(int bucket) { return (bucket == 0) ? 0 : INT64_C(1) << (bucket-1); }
+    static int64_t bucket_max(int bucket) { return (INT64_C(1) << bucket) - 1; }
+
+    // Counts the values of a document in a single pass. The document should be valid.
+    void add(const char* json, size_t size);
+    // Same, for a file, which is loaded like the documents of RandomJson
+    void add_file(const std::string& filepath);
+    // The most frequent keys, the most frequent first
+    std::vector<std::pair<std::string, uint64_t> > frequent_keys(size_t max_number_of_keys) const;
+    // Writes the profile in a text file, with its max_saved_keys most frequent keys. Returns false if it failed.
+    bool save(const std::string& filepath) const;
+    // Replaces the profile by a saved one. Returns false if it failed.
+    bool load(const std::string& filepath);
+};
+
+void JsonProfile::add(const char* json, size_t size)
+{
+    struct Container {
+        bool object;
+        bool expects_key;
+        uint64_t entries;
+    };
+    std::vector<Container> containers;
+    size_t i = (size >= 3 && std::memcmp(json, "\xEF\xBB\xBF", 3) == 0) ? 3 : 0; // BOM
+    uint64_t whitespace = 0;
+    while (i < size) {
+        const char c = json[i];
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            whitespace++;
+            i++;
+            continue;
+        }
+        whitespace_lengths[bucket(whitespace)]++;
+        whitespace = 0;
+        if (c == ',' || c == ':') {
+            if (!containers.empty()) {
+                containers.back().expects_key = containers.back().object && c == ',';
+            }
+            i++;
+            continue;
+        }
+        if (c == ']' || c == '}') {
+            if (!containers.empty()) {
+                (containers.back().object ? objects : arrays)++;
+                (containers.back().object ? object_entries : array_entries) += containers.back().entries;
+                containers.pop_back();
+            }
+            i++;
+            continue;
+        }
+
+        // A key or a value
+        const bool is_key = !containers.empty() && containers.back().expects_key;
+        if (!containers.empty() && (is_key || !containers.back().object)) {
+            containers.back().entries++;
+        }
+        const size_t depth = std::min<size_t>(containers.size(), max_depth-1);
+        if (values.size() <= depth) {
+            values.resize(depth+1);
+        }
+        if (c == '"') {
+            size_t end = i+1;
+            while (end < size && json[end] != '"') {
+                end += (json[end] == '\\') ? 2 : 1;
+            }
+            end = std::min(end, size);
+            if (is_key) {
+                values[depth][structural_key]++;
+                key_counts[std::string(&json[i+1], end-i-1)]++;
+                keys++;
+            }
+            else {
+                values[depth][structural_string]++;
+                string_lengths[bucket(end-i-1)]++;
+            }
+            i = end+1;
+        }
+        else if (c == '{' || c == '[') {
+            values[depth][c == '{' ? structural_object : structural_array]++;
+            Container container = {c == '{', c == '{', 0};
+            containers.push_back(container);
+            i++;
+        }
+        else if (c == '-' || (c >= '0' && c <= '9')) {
+            values[depth][structural_number]++;
+            bool is_float = false;
+            uint64_t digits = 0;
+            size_t end = i;
+            while (end < size) {
+                const char d = json[end];
+                if (d >= '0' && d <= '9') {
+                    digits++;
+                }
+                else if (d == '.' || d == 'e' || d == 'E') {
+                    is_float = true;
+                }
+                else if (d != '-' && d != '+') {
+                    break;
+                }
+                end++;
+            }
+            if (is_float) {
+                floats++;
+            }
+            else {
+                integers++;
+                integer_digits[bucket(digits)]++;
+                negative_integers += (c == '-') ? 1 : 0;
+            }
+            i = end;
+        }
+        else if (c == 't' || c == 'n') {
+            values[depth][c == 't' ? structural_true : structural_null]++;
+            i += 4;
+        }
+        else if (c == 'f') {
+            values[depth][structural_false]++;
+            i += 5;
+        }
+        else {
+            i++; // not json
+        }
+    }
+    generation = next_generation();
+}
+
+std::vector<std::pair<std::string, uint64_t> > JsonProfile::frequent_keys(size_t max_number_of_keys) const
+{
+    std::vector<std::pair<std::string, uint64_t> > frequent(key_counts.begin(), key_counts.end());
+    // The order doesn't depend on the hash table
+    std::sort(frequent.begin(), frequent.end(),
+        [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+    frequent.resize(std::min(frequent.size(), max_number_of_keys));
+    return frequent;
+}
+
+bool JsonProfile::save(const std::string& filepath) const
+{
+    std::ofstream file(filepath, std::ios::out | std::ios::binary);
+    file << "randomjson_profile 1\n";
+    file << "depths " << values.size() << "\n";
+    for (const std::array<uint64_t, structural_null+1>& depth_values : values) {
+        file << "values";
+        for (uint64_t count : depth_values) {
+            file << " " << count;
+        }
+        file << "\n";
+    }
+    const Histogram* histograms[] = {&string_lengths, &whitespace_lengths, &integer_digits};
+    const char* names[] = {"string_lengths", "whitespace_lengths", "integer_digits"};
+    for (int h = 0; h < 3; h++) {
+        file << names[h];
+        for (uint64_t count : *histograms[h]) {
+            file << " " << count;
+        }
+        file << "\n";
+    }
+    file << "numbers " << integers << " " << floats << " " << negative_integers << "\n";
+    file << "containers " << arrays << " " << array_entries << " " << objects << " " << object_entries << "\n";
+    // A key can't have a raw newline, so it takes the end of its line
+    const std::vector<std::pair<std::string, uint64_t> > frequent = frequent_keys(max_saved_keys);
+    file << "keys " << keys << " " << frequent.size() << "\n";
+    for (const std::pair<std::string, uint64_t>& key : frequent) {
+        file << key.second << " " << key.first << "\n";
+    }
+    return static_cast<bool>(file);
+}
+
+bool JsonProfile::load(const std::string& filepath)
+{
+    std::ifstream file(filepath, std::ios::in | std::ios::binary);
+    JsonProfile profile;
+    std::string word;
+    int version = 0;
+    size_t depths = 0;
+    if (!(file >> word >> version) || word != "randomjson_profile" || version != 1 || !(file >> word >> depths) || depths > size_t(max_depth)) {
+        return false;
+    }
+    profile.values.resize(depths);
+    for (std::array<uint64_t, structural_null+1>& depth_values : profile.values) {
+        file >> word;
+        for (uint64_t& count : depth_values) {
+            file >> count;
+        }
+    }
+    Histogram* histograms[] = {&profile.string_lengths, &profile.whitespace_lengths, &profile.integer_digits};
+    for (int h = 0; h < 3; h++) {
+        file >> word;
+        for (uint64_t& count : *histograms[h]) {
+            file >> count;
+        }
+    }
+    size_t number_of_keys = 0;
+    file >> word >> profile.integers >> profile.floats >> profile.negative_integers;
+    file >> word >> profile.arrays >> profile.array_entries >> profile.objects >> profile.object_entries;
+    file >> word >> profile.keys >> number_of_keys;
+    for (size_t k = 0; k < number_of_keys && file; k++) {
+        uint64_t count = 0;
+        std::string key;
+        file >> count;
+        file.get(); // the space
+        std::getline(file, key);
+        profile.key_counts[key] = count;
+    }
+    if (!file) {
+        return false;
+    }
+    *this = profile;
+    generation = next_generation();
+    return true;
+}
+
+// Positions of the tokens targeted by the token mutations, found in a single pass over a document.
+// Generated and loaded documents are both scanned the same way.
+struct TokenTable {
+    std::vector<int64_t> commas;
+    std::vector<int64_t> brackets;
+    std::vector<int64_t> string_starts; // opening quotes
+    std::vector<int64_t> string_ends; // closing quotes
+    std::vector<int64_t> low_surrogates; // first hexadecimal digit of the second half of an escaped surrogate pair
+    std::vector<int64_t> exponents; // 'e' or 'E' of the numbers
+
+    void clear() {
+        commas.clear();
+        brackets.clear();
+        string_starts.clear();
+        string_ends.clear();
+        low_surrogates.clear();
+        exponents.clear();
+    }
+    void build(const char* json, int64_t size) {
+        clear();
+        bool in_string = false;
+        for (int64_t i = 0; i < size; i++) {
+            const char c = json[i];
+            if (in_string) {
+                if (c == '"') {
+                    string_ends.push_back(i);
+                    in_string = false;
+                }
+                else if (c == '\\') {
+                    if (i + 12 <= size && is_high_surrogate(&json[i]) && is_low_surrogate(&json[i+6])) {
+                        low_surrogates.push_back(i+8);
+                    }
+                    i++;
+                }
+                continue;
+            }
+            switch (c) {
+            case '"':
+                string_starts.push_back(i);
+                in_string = true;
+                break;
+            case ',':
+                commas.push_back(i);
+                break;
+            case '[': case ']': case '{': case '}':
+                brackets.push_back(i);
+                break;
+            case 'e': case 'E':
+                // true and false also have an e
+                if (i > 0 && ((json[i-1] >= '0' && json[i-1] <= '9') || json[i-1] == '.')) {
+                    exponents.push_back(i);
+                }
+                break;
+            }
+        }
+        // A string that is not closed
+        if (in_string) {
+            string_ends.push_back(size-1);
+        }
+    }
+
+    private:
+    // \uD800 to \uDBFF, in any case
+    static bool is_high_surrogate(const char* escape) {
+        return escape[1] == 'u' && (escape[2] == 'd' || escape[2] == 'D') && ((escape[3] >= '8' && escape[3] <= '9') || (escape[3] >= 'a' && escape[3] <= 'b') || (escape[3] >= 'A' && escape[3] <= 'B'));
+    }
+    // \uDC00 to \uDFFF, in any case
+    static bool is_low_surrogate(const char* escape) {
+        return escape[0] == '\\' && escape[1] == 'u' && (escape[2] == 'd' || escape[2] == 'D') && ((escape[3] >= 'c' && escape[3] <= 'f') || (escape[3] >= 'C' && escape[3] <= 'F'));
+    }
+};
+
+// Nesting state of the document being generated.
+// For each open container, one bit tells its closing bracket and one bit tells if its next entry needs a comma.
+// The bits are kept in two vectors of 64-bit words, allocated once from the maximal depth.
+class NestingStack {
+    public:
+    NestingStack(int max_depth = 0)
+    : arrays(std::max(max_depth, 0)/64 + 1)
+    , commas(std::max(max_depth, 0)/64 + 1)
+    {}
+
+    // Empties the stack, keeping the memory if it is enough for the new maximal depth
+    void reset(int max_depth) {
+        size_t words = std::max(max_depth, 0)/64 + 1;
+        if (arrays.size() < words) {
+            arrays.resize(words);
+            commas.resize(words);
+        }
+        depth = 0;
+    }
+
+    // Opens a container closed by closer (']' or '}'). Its first entry doesn't need a comma.
+    void push(char closer) {
+        size_t word = depth / 64;
+        uint64_t bit = UINT64_C(1) << (depth % 64);
+        if (closer == ']') {
+            arrays[word] |= bit;
+        }
+        else {
+            arrays[word] &= ~bit;
+        }
+        commas[word] &= ~bit;
+        depth++;
+    }
+    void pop() { depth--; }
+    // Closing bracket of the current container
+    char top() const { return ((arrays[(depth-1) / 64] >> ((depth-1) % 64)) & 1) ? ']' : '}'; }
+    bool needs_comma() const { return (commas[(depth-1) / 64] >> ((depth-1) % 64)) & 1; }
+    // The next entry of the current container needs a comma
+    void set_comma() { commas[(depth-1) / 64] |= UINT64_C(1) << ((depth-1) % 64); }
+    size_t size() const { return depth; }
+    bool empty() const { return depth == 0; }
+
+    // When index is set, the generation records the structure of the document in it.
+    // Its offsets are relative to index_base.
+    StructuralIndex* index = nullptr;
+    const char* index_base = nullptr;
+
+    void record(const char* position, int64_t length, StructuralType type) {
+        if (index != nullptr) {
+            index->add(position - index_base, length, type, depth);
+        }
+    }
+    // Records the container just opened at position
+    void record_open(const char* position) {
+        if (index != nullptr) {
+            index->open(position - index_base, top() == ']' ? structural_array : structural_object, depth-1);
+        }
+    }
+    // Records the closing bracket at position
+    void record_close(const char* position) {
+        if (index != nullptr) {
+            index->close(position - index_base + 1);
+        }
+    }
+    size_t recorded() const { return index != nullptr ? index->size() : 0; }
+    // Forgets what was recorded after the first size entries
+    void forget_since(size_t size) {
+        if (index != nullptr) {
+            index->truncate(size);
+        }
+    }
+
+    private:
+    std::vector<uint64_t> arrays; // 1 for ']', 0 for '}'
+    std::vector<uint64_t> commas;
+    size_t depth = 0;
+};
+
+// Receives a streamed document, one chunk at a time. Returns false if the chunk couldn't be written,
+// and then it doesn't get the rest of the document.
+typedef std::function<bool(const char* chunk, size_t size)> Sink;
+
+const size_t default_chunk_size = 1 << 20;
+
+// Sink writing the chunks to a std::ostream
+Sink ostream_sink(std::ostream& stream)
+{
+    return [&stream](const char* chunk, size_t size) {
+        return stream.write(chunk, size).good();
+    };
+}
+
+// Window through which a streamed document goes.
+// The bytes are written at position(), then committed. Every full chunk is given to the sink.
+class StreamWindow {
+    public:
+    // max_step_size is the largest number of bytes written at position() before they are committed
+    StreamWindow(const Sink& sink, size_t chunk_size, size_t max_step_size)
+    : sink(sink)
+    , chunk_size(chunk_size)
+    , buffer(chunk_size + max_step_size)
+    {}
+
+    char* position() { return &buffer[offset]; }
+    // Number of bytes committed since the beginning
+    int64_t get_committed() { return committed; }
+    void commit(int64_t size) {
+        offset += size;
+        committed += size;
+        int64_t consumed = 0;
+        while (offset-consumed >= static_cast<int64_t>(chunk_size)) {
+            failed = failed || !sink(&buffer[consumed], chunk_size);
+            consumed += chunk_size;
+        }
+        if (consumed > 0) {
+            offset -= consumed;
+            std::memmove(buffer.data(), &buffer[consumed], offset);
+        }
+    }
+    // Gives the last chunk to the sink, even if it is not full. Returns false if the sink failed on any chunk.
+    bool flush() {
+        if (offset > 0) {
+            failed = failed || !sink(buffer.data(), offset);
+        }
+        offset = 0;
+        return !failed;
+    }
+
+    private:
+    const Sink& sink;
+    bool failed = false; // the chunks following a failure are dropped
+    size_t chunk_size;
+    std::vector<char> buffer;
+    int64_t offset = 0; // in the buffer
+    int64_t committed = 0;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+// Sink writing the chunks to a file descriptor
+Sink fd_sink(int fd)
+{
+    return [fd](const char* chunk, size_t size) {
+        // A write may be partial, or interrupted by a signal before writing anything
+        while (size > 0) {
+            ssize_t written = write(fd, chunk, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            chunk += written;
+            size -= written;
+        }
+        return true;
+    };
+}
+#endif
+
+
+// A byte changed by a mutation
+struct MutatedByte {
+    int mutation; // number of the mutation, counting the skipped ones
+    int64_t position;
+    char before;
+    char after;
+};
+
+// Features of a generator, fixed at compile time (see BasicRandomJson).
+// A limit of -1 is taken from the settings at runtime. Otherwise, the settings it replaces are ignored,
+// and the branches of a disabled feature compile away.
+struct RuntimePolicy {
+    static constexpr int max_whitespace_size = -1; // 0 for no whitespace, except to fill the end of the document
+    static constexpr int max_string_size = -1;
+    static constexpr int max_depth = -1;
+    static constexpr bool unicode = true; // non-ascii characters in the strings (according to settings.unicode_weights)
+    static constexpr bool floats = true; // floats among the numbers (according to settings.chances_generating_float)
+    static constexpr bool bom = true; // settings.bom and settings.chances_have_BOM
+    static constexpr bool workloads = true; // settings.workload
+};
+
+// Minified documents of ascii strings and integers, for fuzzing the structural stage of a parser
+struct CompactPolicy {
+    static constexpr int max_whitespace_size = 0;
+    static constexpr int max_string_size = 64;
+    static constexpr int max_depth = 64;
+    static constexpr bool unicode = false;
+    static constexpr bool floats = false;
+    static constexpr bool bom = false;
+    static constexpr bool workloads = false;
+};
 
-class RandomJson {
+// RandomJson specialized for a Policy. RandomJson itself is the runtime policy generator.
+template <typename Policy>
+class BasicRandomJson {
     public:
-    RandomJson(const Settings& settings);
-    ~RandomJson();
+    BasicRandomJson(const Settings& settings);
+    // Streams the document to the sink in chunks of chunk_size bytes instead of keeping it in memory.
+    // The memory used is bounded by the chunk size and the maximal depth, no matter the size of the document.
+    // Since there is no document in memory, get_json() returns nullptr and no mutation is applied.
+    // The errors of the sink are only reported by stream(), which streams the next documents.
+    BasicRandomJson(const Settings& settings, const Sink& sink, size_t chunk_size = default_chunk_size);
+    // Generates the document in a buffer owned by the caller, which is never freed by RandomJson.
+    // If a document doesn't fit in its capacity, RandomJson allocates its own buffer.
+    BasicRandomJson(const Settings& settings, char* buffer, int64_t capacity);
+    ~BasicRandomJson();
 
     // Randomly modify bytes
     void mutate();
-    // Reverse the modifications of the last mutation. Only the last one.
+    // Reverse the modifications of the last mutation. Called again, it reverses the one before, and so on.
     void reverse_mutation();
-    void save(std::string file_name);
+    // Applies again the last reversed mutation. Returns false if there is none.
+    // A new mutation drops the reversed mutations: they can't be redone anymore.
+    bool redo_mutation();
+    // State of the document between two mutations. Taking one costs nothing.
+    typedef size_t Checkpoint;
+    Checkpoint checkpoint();
+    // Bytes changed by the mutations applied to the document, in the order they were changed
+    std::vector<MutatedByte> get_mutations();
+    // Reverses (or redoes) mutations until the document is back at the checkpoint.
+    // It costs the bytes changed in between. A checkpoint is lost if a mutation drops the mutations it follows.
+    void rollback_to(Checkpoint checkpoint);
+    // Returns false if the file couldn't be written
+    bool save(std::string file_name);
+    // Generates (or loads) another document in place.
+    // The buffer is kept and only reallocated when the new document doesn't fit in it.
     void load_settings(const Settings& new_settings);
+    // Same, in a buffer owned by the caller, which is never freed by RandomJson
+    void load_settings(const Settings& new_settings, char* buffer, int64_t capacity);
+    // Streams another document to the sink, like the streaming constructor. The document in memory is released.
+    // Returns false if the sink failed to write a chunk.
+    bool stream(const Settings& new_settings, const Sink& sink, size_t chunk_size = default_chunk_size);
 
     // getters
     const char* get_json();
-    int get_size();
-    int get_generation_seed();
-    int get_mutation_seed();
+    int64_t get_size();
+    uint64_t get_generation_seed();
+    uint64_t get_mutation_seed();
     int get_number_of_mutations();
     bool is_from_file();
+    // Offset and size (without the newline) of each record of a NDJSON document
+    const std::vector<int64_t>& get_record_offsets();
+    const std::vector<int64_t>& get_record_sizes();
+    // Structure of the generated document, if Settings::structural_index is set (or if there are value mutations).
+    // It follows the value mutations, but not the byte mutations.
+    const StructuralIndex& get_structural_index();
     std::string get_filepath();
 
     private:
+    // true if the generation records the structural index
+    bool records_structural_index();
+    // Replaces a random byte
+    void mutate_byte();
+    // Replaces a random value by another one of the same size
+    void mutate_value();
+    // Applies a token mutation. Applies a byte mutation if the document has no token it could target.
+    void mutate_token(MutationType type);
+    // Changes a byte, so it can be restored by reverse_mutation()
+    void replace_byte(int64_t position, char value);
+    // Makes sure the buffer can hold size bytes and the padding. A mapped file is never reused.
+    void reserve(int64_t size);
+    // Zeroes the padding following the document
+    void pad();
+    // true if the last page of a mapping of size bytes has room for the padding
+    bool mapping_has_padding(int64_t size);
+    // Frees the buffer, unless it belongs to the caller
+    void release();
+    // Maps the output file and uses it as the buffer. Returns false if it failed.
+    bool map_output_file(const std::string& filepath, int64_t size);
     // Generates an entire json document
     void generate();
+    // Generates an entire json document and streams it to the sink. Returns false if the sink failed.
+    bool stream(const Sink& sink, size_t chunk_size);
     // Loads a json document from a file
     void load_file(const std::string& filepath);
     // Generates a valid json value taking exactly a given size (in bytes) on a given position.
     // Function's name is poorly chosen.
-    void generate_json(char* json, int size, RandomEngine& random_generator);
+    void generate_json(char* json, int64_t size, NestingStack& nesting, RandomEngine& random_generator);
+    // Generates a valid json value taking exactly a given size through the window of a streamed document
+    void stream_json(StreamWindow& window, int64_t size, NestingStack& nesting, RandomEngine& random_generator);
+    // Number of independent subtrees in the top-level container. 1 if the document is not split.
+    int64_t number_of_subtrees(int64_t size);
+    // Generates a top-level container made of independent subtrees, in parallel
+    void generate_subtrees(char* json, int64_t size, RandomEngine& random_generator);
+    // Number of threads generating a given number of independent parts (subtrees or records),
+    // with a nesting stack for each one in worker_nestings
+    int64_t prepare_workers(int64_t parts);
+    // Same as generate_subtrees(), but streamed
+    void stream_subtrees(StreamWindow& window, int64_t size, RandomEngine& random_generator);
+    // Chooses the offsets and the sizes of the records of size bytes of NDJSON, starting at first_offset
+    void layout_records(int64_t first_offset, int64_t size, RandomEngine& random_generator);
+    // Chooses the blank lines and the size of the record following the first offset bytes of size bytes of NDJSON
+    void layout_record(int64_t offset, int64_t size, int64_t& gap, int64_t& record_size, RandomEngine& random_generator);
+    // Generates the records laid out by layout_records(), from json, in parallel
+    void generate_records(char* json, RandomEngine& random_generator);
+    // Same as generate_records(), but streamed. Each record is laid out when it is streamed.
+    void stream_records(StreamWindow& window, int64_t size, RandomEngine& random_generator);
+    // Writes the blank lines preceding a record, then the record and its newline
+    void generate_record(char* json, int64_t gap, int64_t size, uint64_t seed, uint64_t stream, NestingStack& nesting);
+    // Generates a subtree taking exactly a given size. In an object, the subtree starts with its key.
+    // Its random generator is the given stream of the seed.
+    void generate_subtree(char* json, int64_t size, bool in_object, uint64_t seed, uint64_t stream, NestingStack& nesting);
+    // Inserts the key and the colon before a subtree of an object
+    int insert_subtree_key(char* json, int64_t size, RandomEngine& random_generator);
+    // Largest number of bytes a single step of the generation can write.
+    // The space given to the insert_* functions is bounded by it, so it also bounds the streaming window.
+    int max_entry_size();
+    // Randomly closes the current container, then inserts an entry in the current container.
+    int insert_entry(char* json, NestingStack& nesting, int64_t space_left, RandomEngine& random_generator);
+    // Closes every container left, then fills the given size with whitespaces.
+    int close_everything(char* json, NestingStack& nesting, int64_t size, RandomEngine& random_generator);
     // Inserts a BOM at the beginning of the json document.
     int insert_BOM(char* json);
     // Randomly inserts "{" or "[" in the document.
-    int init_object_or_array(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator);
+    int init_object_or_array(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator);
+    // Inserts "{" or "[" in the document, according to the closing bracket
+    int open_container(char* json, NestingStack& nesting, int max_size, char closing_bracket, RandomEngine& random_generator);
     // Randomly chooses to close or not to close the current container.
-    int randomly_close_bracket(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, RandomEngine& random_generator);
+    int randomly_close_bracket(char* json, NestingStack& nesting, RandomEngine& random_generator);
     // Randomly inserts any json value
-    int insert_value(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator);
+    int insert_value(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator);
     // Inserts a random array entry
-    int insert_array_entry(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator);
+    int insert_array_entry(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator);
     // Inserts a random key followed by a random value.
-    int insert_object_entry(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator);
+    int insert_object_entry(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator);
     // Randomly chooses to insert a random integer or a random float
     int insert_number(char* json, int max_size, RandomEngine& random_generator);
     // Inserts a random integer
@@ -165,25 +1258,133 @@ class RandomJson {
     // Inserts a random sequences of whitespaces for a given size of bytes.
     void insert_givensized_whitespace(char* json, int size, RandomEngine& random_generator);
 
-    char* json;
+    char* json = nullptr;
+    char* allocation = nullptr; // json is aligned inside of it, when RandomJson allocates the buffer
+    int64_t capacity = 0; // bytes available from json, padding included
+    enum BufferKind {
+        owned_buffer, // allocated by RandomJson
+        caller_buffer, // belongs to the caller
+        mapped_buffer // memory mapping of the loaded or the output file
+    };
+    BufferKind buffer_kind = owned_buffer;
+
+    // Reused from one document to the other
+    NestingStack nesting;
+    std::vector<NestingStack> worker_nestings; // one for each thread of a parallel generation
+    std::vector<StructuralIndex> subtree_indexes; // one for each subtree (or record), put together in index
+    StructuralIndex index;
+    std::vector<int64_t> record_offsets;
+    std::vector<int64_t> record_sizes;
 
     RandomEngine generation_random;
     RandomEngine mutation_random;
-
-    // To save value of a mutated byte
+    CodepointSampler codepoint_sampler;
+
+    // Outcomes of the alias tables compiled from the chances of the settings
+    enum ValueKind { object_value, array_value, string_value, number_value, literal_value, number_of_value_kinds };
+    enum NumberKind { integer_number, float_number, number_of_number_kinds };
+    enum LiteralKind { true_literal, null_literal, false_literal, number_of_literal_kinds };
+    AliasTable value_chances;
+    AliasTable container_chances; // object_value or array_value, for the top-level container
+    AliasTable number_chances;
+    AliasTable literal_chances;
+    AliasTable short_literal_chances; // without false, when only 4 bytes are left
+    // 1 when the limit is exceeded, or the piece is invalid
+    AliasTable bom_chances;
+    AliasTable over_number_range_chances;
+    AliasTable over_number_size_chances;
+    AliasTable over_string_size_chances;
+    AliasTable over_whitespace_size_chances;
+    AliasTable over_depth_chances;
+    AliasTable invalid_comma_chances;
+    AliasTable invalid_number_chances;
+    enum StringFault { no_fault, invalid_utf8_fault, invalid_string_fault, invalid_codepoint_fault, number_of_string_faults };
+    AliasTable string_fault_chances;
+    // Compiled from settings.profile, when there is one. The chances of the values and of the numbers come from it too.
+    const JsonProfile* profile = nullptr;
+    std::vector<AliasTable> depth_value_chances; // ValueKind of each depth
+    AliasTable string_length_chances; // buckets of JsonProfile
+    AliasTable whitespace_length_chances;
+    AliasTable integer_digits_chances;
+    // out of 2^16
+    uint32_t array_closing = 0;
+    uint32_t object_closing = 0;
+    uint32_t negative_integers = 0;
+    uint32_t vocabulary_keys = 0;
+    // Most frequent keys of the profile. They are only sorted again when its generation changes.
+    std::vector<std::string> vocabulary;
+    std::vector<uint64_t> cumulated_key_counts;
+    uint64_t vocabulary_generation = 0;
+    // Compiles the alias tables
+    void load_chances();
+    // Compiles the tables of the profile
+    void load_profile(const JsonProfile& new_profile);
+    // Draws a length from a table of buckets of JsonProfile
+    int64_t profile_length(const AliasTable& lengths, RandomEngine& random_generator);
+    // Inserts a key of the profile, or a random string
+    int insert_key(char* json, int max_size, RandomEngine& random_generator);
+    // Limits of the policy, or of the settings
+    int max_whitespace_size() {
+        return (Policy::max_whitespace_size < 0) ? settings.max_whitespace_size : int(Policy::max_whitespace_size);
+    }
+    int max_string_size() { return (Policy::max_string_size < 0) ? settings.max_string_size : int(Policy::max_string_size); }
+    int max_depth() { return (Policy::max_depth < 0) ? settings.max_depth : int(Policy::max_depth); }
+    // Containers may go twice as deep as max_depth when chances_over_max_depth is set
+    int nesting_limit() { return (settings.chances_over_max_depth > 0) ? 2*max_depth() : max_depth(); }
+    Workload workload() { return Policy::workloads ? settings.workload : mixed_workload; }
+
+    // Undo log. It is append-only, except that a new mutation drops the undone mutations that could be redone.
+    // Each mutated byte is saved before and after its mutation.
     struct SavedByte {
-        int position;
-        char value;
+        int64_t position;
+        char before;
+        char after;
     };
     std::vector<SavedByte> saved_bytes;
+    // A mutation owns the saved bytes from first_byte to the first_byte of the next one.
+    // A value mutation also saves the index entry of the value before and after it (entry is -1 otherwise).
+    struct LoggedMutation {
+        size_t first_byte;
+        int number; // counting the skipped mutations
+        int64_t entry;
+        int64_t lengths[2];
+        uint8_t types[2];
+    };
+    std::vector<LoggedMutation> mutation_log;
+    size_t applied_mutations = 0; // the following ones are undone
+    // Restores the document and the index as before or after a logged mutation
+    void apply_logged_mutation(size_t mutation, bool after);
+    // Forgets every mutation
+    void clear_mutation_log();
+    // Applies the first mutations, except the skipped ones
+    void apply_mutations(int number_of_mutations);
+    // Built on the first token mutation of a document
+    TokenTable tokens;
+    bool tokens_built = false;
+    // Set during a value mutation: the values are valid and within the limits, whatever the chances of faults
+    bool valid_values_only = false;
 
     Settings settings;
 };
 
-RandomJson::RandomJson(const Settings& settings)
-: settings(settings)
+// Generator whose features are all taken from the settings
+typedef BasicRandomJson<RuntimePolicy> RandomJson;
+
+void JsonProfile::add_file(const std::string& filepath)
+{
+    Settings settings(0, 0, 0);
+    settings.filepath = filepath;
+    RandomJson random_json(settings);
+    add(random_json.get_json(), random_json.get_size());
+}
+
+template <typename Policy>
+BasicRandomJson<Policy>::BasicRandomJson(const Settings& settings)
+: settings(settings)
 {
     generation_random.seed(settings.generation_seed);
+    codepoint_sampler.load(settings.unicode_weights);
+    load_chances();
     mutation_random.seed(settings.mutation_seed);
     if (settings.filepath != "") {
         load_file(settings.filepath);
@@ -192,17 +1393,188 @@ RandomJson::RandomJson(const Settings& settings)
         generate();
     }
 
-    for (int i = 0; i < settings.number_of_mutations; i++) {
-        mutate();
+    apply_mutations(settings.number_of_mutations);
+}
+
+template <typename Policy>
+BasicRandomJson<Policy>::BasicRandomJson(const Settings& settings, const Sink& sink, size_t chunk_size)
+: settings(settings)
+{
+    generation_random.seed(settings.generation_seed);
+    codepoint_sampler.load(settings.unicode_weights);
+    load_chances();
+    mutation_random.seed(settings.mutation_seed);
+    stream(sink, chunk_size);
+}
+
+template <typename Policy>
+BasicRandomJson<Policy>::BasicRandomJson(const Settings& settings, char* buffer, int64_t capacity)
+: json(buffer)
+, capacity(capacity)
+, buffer_kind(caller_buffer)
+, settings(settings)
+{
+    generation_random.seed(settings.generation_seed);
+    codepoint_sampler.load(settings.unicode_weights);
+    load_chances();
+    mutation_random.seed(settings.mutation_seed);
+    if (settings.filepath != "") {
+        load_file(settings.filepath);
+    }
+    else {
+        generate();
+    }
+
+    apply_mutations(settings.number_of_mutations);
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::load_settings(const Settings& new_settings, char* buffer, int64_t capacity) {
+    release();
+    json = buffer;
+    this->capacity = capacity;
+    buffer_kind = caller_buffer;
+    load_settings(new_settings);
+}
+
+template <typename Policy>
+BasicRandomJson<Policy>::~BasicRandomJson()
+{
+    release();
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::load_chances()
+{
+    const float values[number_of_value_kinds] = {
+        settings.chances_generating_object,
+        settings.chances_generating_array,
+        settings.chances_generating_string,
+        settings.chances_generating_number,
+        settings.chances_generating_true + settings.chances_generating_false + settings.chances_generating_null
+    };
+    value_chances.load(values, number_of_value_kinds);
+    const bool no_container = values[object_value] <= 0 && values[array_value] <= 0;
+    const float containers[2] = {no_container ? 0 : values[object_value], no_container ? 1 : values[array_value]};
+    container_chances.load(containers, 2);
+    const float numbers[number_of_number_kinds] = {settings.chances_generating_integer, settings.chances_generating_float};
+    number_chances.load(numbers, number_of_number_kinds);
+    const float literals[number_of_literal_kinds] = {
+        settings.chances_generating_true,
+        settings.chances_generating_null,
+        settings.chances_generating_false
+    };
+    literal_chances.load(literals, number_of_literal_kinds);
+    short_literal_chances.load(literals, 2);
+    bom_chances.load_probability(settings.chances_have_BOM);
+    over_number_range_chances.load_probability(settings.chances_over_max_number_range);
+    over_number_size_chances.load_probability(settings.chances_over_max_number_size);
+    over_string_size_chances.load_probability(settings.chances_over_max_string_size);
+    over_whitespace_size_chances.load_probability(settings.chances_over_max_whitespace_size);
+    over_depth_chances.load_probability(settings.chances_over_max_depth);
+    invalid_comma_chances.load_probability(settings.chances_invalid_comma);
+    invalid_number_chances.load_probability(settings.chances_invalid_number);
+    const float faults[number_of_string_faults] = {
+        1 - settings.chances_invalid_utf8 - settings.chances_invalid_string - settings.chances_invalid_codepoint,
+        settings.chances_invalid_utf8,
+        settings.chances_invalid_string,
+        settings.chances_invalid_codepoint
+    };
+    string_fault_chances.load(faults, number_of_string_faults);
+    if (settings.profile) {
+        load_profile(*settings.profile);
+    }
+    else {
+        profile = nullptr;
+        depth_value_chances.clear();
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::load_profile(const JsonProfile& new_profile)
+{
+    depth_value_chances.resize(std::max<size_t>(new_profile.values.size(), 1));
+    float literals[number_of_literal_kinds] = {0, 0, 0};
+    for (size_t depth = 0; depth < new_profile.values.size(); depth++) {
+        const std::array<uint64_t, structural_null+1>& values = new_profile.values[depth];
+        const float weights[number_of_value_kinds] = {
+            float(values[structural_object]),
+            float(values[structural_array]),
+            float(values[structural_string]),
+            float(values[structural_number]),
+            float(values[structural_true] + values[structural_false] + values[structural_null])
+        };
+        depth_value_chances[depth].load(weights, number_of_value_kinds);
+        literals[true_literal] += values[structural_true];
+        literals[null_literal] += values[structural_null];
+        literals[false_literal] += values[structural_false];
+    }
+    if (!new_profile.values.empty() && (new_profile.values[0][structural_object] != 0 || new_profile.values[0][structural_array] != 0)) {
+        const float containers[2] = {float(new_profile.values[0][structural_object]), float(new_profile.values[0][structural_array])};
+        container_chances.load(containers, 2);
+    }
+    literal_chances.load(literals, number_of_literal_kinds);
+    short_literal_chances.load(literals, 2);
+    const float numbers[number_of_number_kinds] = {float(new_profile.integers), float(new_profile.floats)};
+    number_chances.load(numbers, number_of_number_kinds);
+
+    float lengths[JsonProfile::number_of_buckets];
+    const JsonProfile::Histogram* histograms[] = {&new_profile.string_lengths, &new_profile.whitespace_lengths, &new_profile.integer_digits};
+    AliasTable* tables[] = {&string_length_chances, &whitespace_length_chances, &integer_digits_chances};
+    for (int h = 0; h < 3; h++) {
+        for (int bucket = 0; bucket < JsonProfile::number_of_buckets; bucket++) {
+            lengths[bucket] = float((*histograms[h])[bucket]);
+        }
+        tables[h]->load(lengths, JsonProfile::number_of_buckets);
     }
+
+    // A container of n entries on average is closed before an entry with a probability of 1/(n+1)
+    const double full = 1 << 16;
+    array_closing = (new_profile.arrays == 0) ? 1 << 14 : uint32_t(full * new_profile.arrays / (new_profile.arrays + new_profile.array_entries));
+    object_closing = (new_profile.objects == 0) ? 1 << 14 : uint32_t(full * new_profile.objects / (new_profile.objects + new_profile.object_entries));
+    negative_integers = (new_profile.integers == 0) ? 0 : uint32_t(full * new_profile.negative_integers / new_profile.integers);
+
+    if (new_profile.generation == 0 || new_profile.generation != vocabulary_generation) {
+        vocabulary_generation = new_profile.generation;
+        vocabulary.clear();
+        cumulated_key_counts.clear();
+        uint64_t cumulated = 0;
+        for (const std::pair<std::string, uint64_t>& key : new_profile.frequent_keys(JsonProfile::max_saved_keys)) {
+            vocabulary.push_back(key.first);
+            cumulated += key.second;
+            cumulated_key_counts.push_back(cumulated);
+        }
+        vocabulary_keys = (new_profile.keys == 0) ? 0 : uint32_t(std::min(full, full * cumulated / new_profile.keys));
+    }
+    profile = &new_profile;
+}
+
+template <typename Policy>
+int64_t BasicRandomJson<Policy>::profile_length(const AliasTable& lengths, RandomEngine& random_generator)
+{
+    const int bucket = lengths.next(random_generator);
+    return random_generator.next_ranged_int64(JsonProfile::bucket_min(bucket), JsonProfile::bucket_max(bucket));
 }
 
-RandomJson::~RandomJson()
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_key(char* json, int max_size, RandomEngine& random_generator)
 {
-    delete[] json;
+    if (profile != nullptr && !vocabulary.empty() && random_generator.next_bits(16) < vocabulary_keys) {
+        const uint64_t drawn = random_generator.next_ranged_int64(0, cumulated_key_counts.back()-1);
+        const size_t k = std::upper_bound(cumulated_key_counts.begin(), cumulated_key_counts.end(), drawn) - cumulated_key_counts.begin();
+        const int size = static_cast<int>(vocabulary[k].size()) + 2;
+        if (size <= std::min(max_size, max_string_size())) {
+            json[0] = '"';
+            std::memcpy(&json[1], vocabulary[k].data(), vocabulary[k].size());
+            json[size-1] = '"';
+            return size;
+        }
+    }
+    return insert_string(json, max_size, random_generator);
 }
 
-int RandomJson::insert_BOM(char* json)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_BOM(char* json)
 {
     int size = 3;
     json[0] = 0xEF;
@@ -212,7 +1584,62 @@ int RandomJson::insert_BOM(char* json)
     return size;
 }
 
-int RandomJson::insert_integer(char* json, int max_size, RandomEngine& random_generator)
+// Writes the decimal digits of value just before end, two digits at a time.
+// Returns a pointer to the first digit. 20 chars are enough for any value.
+char* format_decimal(uint64_t value, char* end)
+{
+    static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+    char* first = end;
+    while (value >= 100) {
+        int pair = static_cast<int>(value % 100) * 2;
+        value /= 100;
+        first -= 2;
+        first[0] = digit_pairs[pair];
+        first[1] = digit_pairs[pair+1];
+    }
+    if (value >= 10) {
+        int pair = static_cast<int>(value) * 2;
+        first -= 2;
+        first[0] = digit_pairs[pair];
+        first[1] = digit_pairs[pair+1];
+    }
+    else {
+        first--;
+        first[0] = static_cast<char>('0' + value);
+    }
+    return first;
+}
+
+// Writes a malformed number of 3 bytes: a leading zero, a dot without digits on one side,
+// an exponent without digits, or a plus sign
+int insert_invalid_number(char* json, int max_size, RandomEngine& random_generator) {
+    const int min_size = 3;
+    int size = 0;
+    if (min_size > max_size) {
+        return size;
+    }
+
+    // d stands for a digit from 1 to 9
+    const char* forms[] = {"0dd", "dd.", ".dd", "-.d", "de+", "+dd"};
+    const char* form = forms[random_generator.next_ranged_int(0, 5)];
+    for (; size < min_size; size++) {
+        json[size] = (form[size] == 'd') ? static_cast<char>('1' + random_generator.next_ranged_int(0, 8)) : form[size];
+    }
+    return size;
+}
+
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_integer(char* json, int max_size, RandomEngine& random_generator)
 {
     const int min_size = 1;
     int size = 0;
@@ -220,23 +1647,41 @@ int RandomJson::insert_integer(char* json, int max_size, RandomEngine& random_ge
         return size;
     }
 
-    uint64_t number = random_generator.next_int();
+    if (profile != nullptr) {
+        // The digits and the sign of the integers of the profile
+        const int sign_size = (max_size > 1 && random_generator.next_bits(16) < negative_integers) ? 1 : 0;
+        const int64_t digits = std::min<int64_t>(std::max<int64_t>(profile_length(integer_digits_chances, random_generator), 1), std::min(max_size - sign_size, 19));
+        json[0] = '-';
+        json[sign_size] = static_cast<char>((digits == 1 ? '0' : '1') + random_generator.next_ranged_int(0, digits == 1 ? 9 : 8));
+        for (int64_t i = 1; i < digits; i++) {
+            json[sign_size + i] = static_cast<char>('0' + random_generator.next_ranged_int(0, 9));
+        }
+        size = sign_size + static_cast<int>(digits);
+        return size;
+    }
+
+    int64_t number = random_generator.next_int();
 
     // preventing single minus sign
     if (max_size == min_size && number < 0) {
         number = -number;
     }
 
-    // Inserting the most digits we can
-    std::string string_number = std::to_string(number);
-    size = std::min(static_cast<int>(string_number.size()), max_size);
-    for (int i = 0; i < size; i++) {
-        json[i] = string_number.at(i);
+    // sign and digits are written in a small buffer, then we insert the most we can
+    char buffer[21];
+    char* end = buffer + sizeof(buffer);
+    char* first = format_decimal(number < 0 ? -static_cast<uint64_t>(number) : number, end);
+    if (number < 0) {
+        first--;
+        first[0] = '-';
     }
+    size = std::min(static_cast<int>(end - first), max_size);
+    std::memcpy(json, first, size);
     return size;
 }
 
-int RandomJson::insert_float(char* json, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_float(char* json, int max_size, RandomEngine& random_generator)
 {
     const int min_size = 3; // single digit + dot + single digit
     int size = 0;
@@ -254,35 +1699,49 @@ int RandomJson::insert_float(char* json, int max_size, RandomEngine& random_gene
     }
 
     uint64_t significant = random_generator.next();
-    std::string string_significant = std::to_string(significant);
+    char significant_buffer[20];
+    char* significant_end = significant_buffer + sizeof(significant_buffer);
+    char* significant_digits = format_decimal(significant, significant_end);
+    int significant_size = static_cast<int>(significant_end - significant_digits);
 
     // trying to insert a dot
     int dot_position = 0;
     bool dot_inserted = false;
-    int max_dot_position = std::min(static_cast<int>(string_significant.size()), max_size - offset) - 1;
+    int max_dot_position = std::min(significant_size, max_size - offset) - 1;
     dot_position = random_generator.next_ranged_int(0, max_dot_position);
     if (dot_position < max_dot_position-1) { // A dot can't end a float. We leave a chance to not insert a dot.
         if (dot_position == 0) {
-            string_significant.at(0) = '0';
-            string_significant.at(1) = '.';
+            significant_digits[0] = '0';
+            significant_digits[1] = '.';
         }
         else {
-            string_significant.at(dot_position) = '.';
+            significant_digits[dot_position] = '.';
         }
         dot_inserted = true;
     }
     // inserting all we can from the significant
-    int space_for_significant = std::min(static_cast<int>(string_significant.size()), max_size - offset);
+    int space_for_significant = std::min(significant_size, max_size - offset);
     if (!dot_inserted) {
         space_for_significant -= 2;
     }
-    for (int i = 0; i < space_for_significant; i++) {
-        json[offset] = string_significant.at(i);
-        offset++;
+    if (space_for_significant > 0) {
+        std::memcpy(&json[offset], significant_digits, space_for_significant);
+        offset += space_for_significant;
     }
 
-    int exponent = random_generator.next_ranged_int(0, settings.max_number_range-dot_position);
-    std::string string_exponent = std::to_string(exponent);
+    // An exponent over the range goes up to twice the range
+    int exponent = 0;
+    if (!valid_values_only && over_number_range_chances.next(random_generator) == 1) {
+        const int min_exponent = std::max(settings.max_number_range-dot_position, 0) + 1;
+        exponent = random_generator.next_ranged_int(min_exponent, std::max(min_exponent, 2*settings.max_number_range));
+    }
+    else {
+        exponent = random_generator.next_ranged_int(0, settings.max_number_range-dot_position);
+    }
+    char exponent_buffer[20];
+    char* exponent_end = exponent_buffer + sizeof(exponent_buffer);
+    char* exponent_digits = format_decimal(exponent, exponent_end);
+    int exponent_size = static_cast<int>(exponent_end - exponent_digits);
 
     // trying to insert the exponent
     const int required_space_for_exponent = 2; // e + one digit
@@ -312,11 +1771,9 @@ int RandomJson::insert_float(char* json, int max_size, RandomEngine& random_gene
         }
 
         // Inserting the most digits we can for the exponent
-        int space_for_exponent = std::min(static_cast<int>(string_exponent.size()), max_size - offset);
-        for (int i = 0; i < space_for_exponent; i++) {
-            json[offset] = string_exponent.at(i);
-            offset++;
-        }
+        int space_for_exponent = std::min(exponent_size, max_size - offset);
+        std::memcpy(&json[offset], exponent_digits, space_for_exponent);
+        offset += space_for_exponent;
     }
     
     size = offset;
@@ -324,7 +1781,8 @@ int RandomJson::insert_float(char* json, int max_size, RandomEngine& random_gene
     return size;
 }
 
-int RandomJson::insert_number(char* json, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_number(char* json, int max_size, RandomEngine& random_generator)
 {
     const int min_size = 1;
     int size = 0;
@@ -332,16 +1790,35 @@ int RandomJson::insert_number(char* json, int max_size, RandomEngine& random_gen
         return size;
     }
 
-    // boolean used to choose between two cases. No truthness involved.
-    switch (random_generator.next_bool()) {
-        case true:
-            size = insert_float(json, max_size, random_generator);
-            break;
-        case false:
-            size = insert_integer(json, max_size, random_generator);
-            break;
+    if (!valid_values_only && invalid_number_chances.next(random_generator) == 1) {
+        size = insert_invalid_number(json, max_size, random_generator);
+        if (size != 0) {
+            return size;
+        }
+    }
+    if (!valid_values_only && over_number_size_chances.next(random_generator) == 1 && max_size > settings.max_number_size) {
+        // An integer of up to twice the digits
+        size = random_generator.next_ranged_int(settings.max_number_size+1, std::min(max_size, 2*settings.max_number_size+1));
+        json[0] = static_cast<char>('1' + random_generator.next_ranged_int(0, 8));
+        for (int i = 1; i < size; i++) {
+            json[i] = static_cast<char>('0' + random_generator.next_ranged_int(0, 9));
+        }
+        return size;
+    }
+    max_size = std::min(max_size, settings.max_number_size);
+    if (min_size > max_size) {
+        return size;
     }
 
+    if (Policy::floats && number_chances.next(random_generator) == float_number) {
+        size = insert_float(json, max_size, random_generator);
+        // A float needs 3 bytes
+        if (size != 0) {
+            return size;
+        }
+    }
+    size = insert_integer(json, max_size, random_generator);
+
     return size;
 }
 
@@ -353,15 +1830,13 @@ int insert_escaped_codepoint(char* json, int max_size, RandomEngine& random_gene
         return size;
     }
 
-    // multi purpose random bits
-    uint64_t random_bits = random_generator.next();
-    uint16_t wanabe_codepoint = random_bits & 0xffff;
+    uint16_t wanabe_codepoint = random_generator.next_bits(16);
 
     bool is_low_surrogate = false;
     bool is_high_surrogate = false;
 
     // will be use if the first codepoint is the part of a surrogate pair
-    uint16_t second_wanabe_codepoint;
+    uint16_t second_wanabe_codepoint = 0;
 
     // checking if we have a surrogate pair
     if (0xd800 <= wanabe_codepoint && wanabe_codepoint <= 0xdbff) {
@@ -388,8 +1863,8 @@ int insert_escaped_codepoint(char* json, int max_size, RandomEngine& random_gene
         wanabe_codepoint = random_generator.next_ranged_int(0xd800, 0xdbff);
     }
 
-    // will be used to randomly chose between capital or minuscule hexa digit
-    random_bits >>= 16;
+    // will be used to randomly chose between capital or minuscule hexa digit (one bit per digit, starting at 0x10)
+    uint64_t random_bits = random_generator.next_bits(8) << 4;
 
     // inserting codepoint
     json[3] = hexa_digits[(wanabe_codepoint & 0xf) + (random_bits & 0x10)];
@@ -427,115 +1902,339 @@ int insert_escaped_codepoint(char* json, int max_size, RandomEngine& random_gene
     return size;
 }
 
-int RandomJson::insert_string(char* json, int max_size, RandomEngine& random_generator) {
-    int min_size = 2;
+// Turns 32 random bytes into 32 printable ascii characters, none of them being '"' or '\\'.
+// Returns a mask of the positions where something else than an ascii character is inserted:
+// the random bytes starting with three 1 bits, one time out of eight.
+uint32_t ascii_block(const uint8_t* random_bytes, char* ascii)
+{
+#if defined(__AVX2__)
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(random_bytes));
+    __m256i characters = _mm256_and_si256(bytes, _mm256_set1_epi8(0x7f));
+    // control characters become 0x40 to 0x5f
+    __m256i control = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), characters);
+    characters = _mm256_add_epi8(characters, _mm256_and_si256(control, _mm256_set1_epi8(0x40)));
+    // '"' becomes 'b' and '\\' becomes '|'
+    __m256i quote = _mm256_and_si256(_mm256_cmpeq_epi8(characters, _mm256_set1_epi8('"')), _mm256_set1_epi8(0x40));
+    __m256i backslash = _mm256_and_si256(_mm256_cmpeq_epi8(characters, _mm256_set1_epi8('\\')), _mm256_set1_epi8(0x20));
+    characters = _mm256_xor_si256(characters, _mm256_or_si256(quote, backslash));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(ascii), characters);
+    __m256i special = _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, _mm256_set1_epi8(static_cast<char>(0xe0))), bytes);
+    return static_cast<uint32_t>(_mm256_movemask_epi8(special));
+#elif defined(__SSE2__)
+    uint32_t mask = 0;
+    for (int half = 0; half < 2; half++) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&random_bytes[16*half]));
+        __m128i characters = _mm_and_si128(bytes, _mm_set1_epi8(0x7f));
+        __m128i control = _mm_cmpgt_epi8(_mm_set1_epi8(0x20), characters);
+        characters = _mm_add_epi8(characters, _mm_and_si128(control, _mm_set1_epi8(0x40)));
+        __m128i quote = _mm_and_si128(_mm_cmpeq_epi8(characters, _mm_set1_epi8('"')), _mm_set1_epi8(0x40));
+        __m128i backslash = _mm_and_si128(_mm_cmpeq_epi8(characters, _mm_set1_epi8('\\')), _mm_set1_epi8(0x20));
+        characters = _mm_xor_si128(characters, _mm_or_si128(quote, backslash));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&ascii[16*half]), characters);
+        __m128i special = _mm_cmpeq_epi8(_mm_max_epu8(bytes, _mm_set1_epi8(static_cast<char>(0xe0))), bytes);
+        mask |= static_cast<uint32_t>(_mm_movemask_epi8(special)) << (16*half);
+    }
+    return mask;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < 32; i++) {
+        uint8_t character = random_bytes[i] & 0x7f;
+        if (character < 0x20) {
+            character += 0x40;
+        }
+        if (character == '"') {
+            character ^= 0x40;
+        }
+        if (character == '\\') {
+            character ^= 0x20;
+        }
+        ascii[i] = static_cast<char>(character);
+        if (random_bytes[i] >= 0xe0) {
+            mask |= UINT32_C(1) << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+// Inserts a code point of the supplementary planes as an escaped surrogate pair of 12 bytes, like \uD83D\uDE00
+int insert_escaped_surrogate_pair(char* json, int max_size, RandomEngine& random_generator)
+{
+    const char hexa_digits[] = "0123456789ABCDEF";
+    const int min_size = 12;
     int size = 0;
     if (min_size > max_size) {
         return size;
     }
 
-    max_size = std::min(max_size, settings.max_string_size);
+    // A code point of the other planes, as \uD800-\uDBFF followed by \uDC00-\uDFFF
+    uint32_t codepoint = random_generator.next_ranged_int(0, 0xfffff);
+    uint16_t halves[2] = {static_cast<uint16_t>(0xd800 + (codepoint >> 10)), static_cast<uint16_t>(0xdc00 + (codepoint & 0x3ff))};
+    for (uint16_t half : halves) {
+        json[size] = '\\';
+        json[size+1] = 'u';
+        for (int i = 0; i < 4; i++) {
+            json[size+2+i] = hexa_digits[(half >> (12 - 4*i)) & 0xf];
+        }
+        size += 6;
+    }
+    return size;
+}
 
-    int offset = 0;
-    json[offset] = '"';
-    offset++;
+// Inserts an escape sequence, like \n or \u00E9
+int insert_escape_sequence(char* json, int max_size, RandomEngine& random_generator)
+{
+    const int min_size = 2;
+    int size = 0;
+    if (min_size > max_size) {
+        return size;
+    }
 
-    bool s = false;
-    bool closed = false;
-    int remaining_size;
+    const char escaped_char[] = "\"\\/bfnrtu";
+    const int nb_escaped_char = 9;
+    json[0] = '\\';
+    json[1] = escaped_char[random_generator.next_ranged_int(0, nb_escaped_char-1)];
+    if (json[1] == 'u') {
+        int codepoint_size = insert_escaped_codepoint(&json[min_size], max_size-min_size, random_generator);
+        if (codepoint_size == 0) {
+            return size;
+        }
+        size = min_size + codepoint_size;
+    }
+    else {
+        size = min_size;
+    }
+    return size;
+}
+
+// Inserts a random multibyte utf-8 character, taken from the code point sampler
+int insert_utf8_character(char* json, int max_size, const CodepointSampler& codepoint_sampler, RandomEngine& random_generator)
+{
+    int size = 0;
+    if (codepoint_sampler.empty()) {
+        return size;
+    }
+    uint32_t codepoint = codepoint_sampler.next(random_generator);
     unsigned char* ujson = reinterpret_cast<unsigned char*>(json); // won't have to cast all the time
-    while ((remaining_size = max_size - offset -1) > 0) {
-        json[offset] = random_generator.next_char();
 
-        // Closing quote. The string is closing by itself.
-        if (json[offset] == '"') {
-            offset++;
-            closed = true;
-            break;
+    // two bytes character
+    if (codepoint < 0x800) {
+        const int char_size = 2;
+        if (max_size < char_size) {
+            return size;
+        }
+        ujson[0] = 0xc0 | (codepoint >> 6);
+        ujson[1] = 0x80 | (codepoint & 0x3f);
+        size = char_size;
+    }
+    // three bytes character
+    else if (codepoint < 0x10000) {
+        const int char_size = 3;
+        if (max_size < char_size) {
+            return size;
         }
+        ujson[0] = 0xe0 | (codepoint >> 12);
+        ujson[1] = 0x80 | ((codepoint >> 6) & 0x3f);
+        ujson[2] = 0x80 | (codepoint & 0x3f);
+        size = char_size;
+    }
+    // four bytes character
+    else {
+        const int char_size = 4;
+        if (max_size < char_size) {
+            return size;
+        }
+        ujson[0] = 0xf0 | (codepoint >> 18);
+        ujson[1] = 0x80 | ((codepoint >> 12) & 0x3f);
+        ujson[2] = 0x80 | ((codepoint >> 6) & 0x3f);
+        ujson[3] = 0x80 | (codepoint & 0x3f);
+        size = char_size;
+    }
+    return size;
+}
 
-        // trying to insert escaped stuff
-        if (json[offset] == '\\') {
-            const int min_escaped_size = 2;
-            if (remaining_size < min_escaped_size) {
-                continue;
-            }
-            const char escaped_char[] = "\"\\bfnrtu";
-            const int nb_escaped_char = 8;
-            int position = random_generator.next_ranged_int(0, nb_escaped_char-1);
-            json[offset+1] = escaped_char[position];
+// Writes a byte sequence that isn't UTF-8: a continuation byte alone, a leading byte without its continuation
+// (a string never continues with one), an overlong encoding, an encoded surrogate, or a byte that UTF-8 never uses
+int insert_invalid_utf8(char* json, int max_size, RandomEngine& random_generator)
+{
+    const int min_size = 3;
+    int size = 0;
+    if (min_size > max_size) {
+        return size;
+    }
 
-            if (json[offset+1] == 'u') {
-                int size = insert_escaped_codepoint(&json[offset+min_escaped_size], remaining_size-2, random_generator);
-                if (size == 0) {
-                    continue;
-                }
-                offset += size + min_escaped_size;
-            }
-            else {
-                offset += min_escaped_size;
-            }
-            continue;
-            
-        }
+    unsigned char* ujson = reinterpret_cast<unsigned char*>(json);
+    const unsigned char continuation = static_cast<unsigned char>(0x80 | random_generator.next_bits(6));
+    switch (random_generator.next_ranged_int(0, 4)) {
+    case 0:
+        ujson[0] = continuation;
+        size = 1;
+        break;
+    case 1:
+        ujson[0] = static_cast<unsigned char>(random_generator.next_ranged_int(0xc2, 0xf4));
+        size = 1;
+        break;
+    case 2:
+        ujson[0] = static_cast<unsigned char>(0xc0 | random_generator.next_bits(1));
+        ujson[1] = continuation;
+        size = 2;
+        break;
+    case 3:
+        ujson[0] = 0xed;
+        ujson[1] = static_cast<unsigned char>(0xa0 | random_generator.next_bits(5));
+        ujson[2] = continuation;
+        size = 3;
+        break;
+    default:
+        ujson[0] = static_cast<unsigned char>(random_generator.next_ranged_int(0xf5, 0xff));
+        size = 1;
+        break;
+    }
+    return size;
+}
 
-        // one byte character
-        if (0x20 <= ujson[offset] && ujson[offset] <= 0x7f) {
-            offset++;
-            continue;
-        }
+// Writes a control character, which a string can only have escaped, or an escape sequence that doesn't exist
+int insert_invalid_string(char* json, int max_size, RandomEngine& random_generator)
+{
+    const int min_size = 2;
+    int size = 0;
+    if (min_size > max_size) {
+        return size;
+    }
 
-        // two bytes character
-        if (0xc2 <= ujson[offset] && ujson[offset] <= 0xdf) {
-            const int char_size = 2;
-            if (remaining_size < char_size) {
-                continue;
+    if (random_generator.next_bool()) {
+        json[0] = static_cast<char>(random_generator.next_ranged_int(0x01, 0x1f));
+        size = 1;
+    }
+    else {
+        const char unknown_escapes[] = "acdeghijklmopqsvwxyzU0'";
+        json[0] = '\\';
+        json[1] = unknown_escapes[random_generator.next_ranged_int(0, sizeof(unknown_escapes)-2)];
+        size = 2;
+    }
+    return size;
+}
+
+// Writes an escaped high surrogate followed by an escaped ascii character instead of a low surrogate,
+// or an escaped codepoint with a character that isn't an hexadecimal digit
+int insert_invalid_codepoint(char* json, int max_size, RandomEngine& random_generator)
+{
+    const char hexa_digits[] = "0123456789ABCDEF";
+    const int min_size = 6;
+    const int unpaired_surrogate_size = 12;
+    int size = 0;
+    if (min_size > max_size) {
+        return size;
+    }
+
+    if (max_size >= unpaired_surrogate_size && random_generator.next_bool()) {
+        const uint32_t high_surrogate = static_cast<uint32_t>(random_generator.next_ranged_int(0xd800, 0xdbff));
+        const uint32_t ascii = static_cast<uint32_t>(random_generator.next_ranged_int(0x20, 0x7e));
+        for (uint32_t half : {high_surrogate, ascii}) {
+            json[size] = '\\';
+            json[size+1] = 'u';
+            for (int i = 0; i < 4; i++) {
+                json[size+2+i] = hexa_digits[(half >> (12 - 4*i)) & 0xf];
             }
-            json[offset+1] = random_generator.next_ranged_int(0x80, 0xbf);
-            offset += char_size;
-            continue;
+            size += 6;
         }
+    }
+    else {
+        json[0] = '\\';
+        json[1] = 'u';
+        for (int i = 0; i < 4; i++) {
+            json[2+i] = hexa_digits[random_generator.next_bits(4)];
+        }
+        json[2 + random_generator.next_ranged_int(0, 3)] = static_cast<char>('g' + random_generator.next_ranged_int(0, 19));
+        size = min_size;
+    }
+    return size;
+}
 
-        // three bytes character
-        if (0xec <= ujson[offset] && ujson[offset] <= 0xef) {
-            const int char_size = 3;
-            if (remaining_size < char_size) {
-                continue;
-            }
-            if (ujson[offset] == 0xed) {
-                json[offset+1] = random_generator.next_ranged_int(0x80, 0x9f);
-            }
-            else {
-                json[offset+1] = random_generator.next_ranged_int(0x80, 0xbf);
-            }
-            json[offset+2] = random_generator.next_ranged_int(0x80, 0xbf);
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_string(char* json, int max_size, RandomEngine& random_generator) {
+    int min_size = 2;
+    int size = 0;
+    if (min_size > max_size) {
+        return size;
+    }
 
-            offset += char_size;
-            continue;
-        }
+    // A string over its maximum takes a length drawn up to twice the maximum, instead of closing by itself
+    const bool over_size = !valid_values_only && over_string_size_chances.next(random_generator) == 1 && max_size > max_string_size() + 2;
+    if (over_size) {
+        max_size = random_generator.next_ranged_int(max_string_size() + 3, std::min(max_size, 2*max_string_size() + 2));
+    }
+    else {
+        max_size = std::min(max_size, max_string_size());
+    }
+    if (profile != nullptr && !over_size) {
+        // The string takes the length drawn, instead of closing by itself
+        max_size = static_cast<int>(std::min<int64_t>(max_size, profile_length(string_length_chances, random_generator) + 2));
+    }
 
-        // four bytes character
-        if (0xf0 <= ujson[offset] && ujson[offset] <= 0xf4) {
-            const int char_size = 4;
-            if (remaining_size < char_size) {
+    int offset = 0;
+    json[offset] = '"';
+    offset++;
+
+    // The body is built by blocks of 32 ascii characters made at once from 32 random bytes.
+    // At the special positions of a block, the string is closed, or an escaped character
+    // or a multibyte character is inserted instead, depending on the random byte.
+    const int block_size = 32;
+    uint64_t random_words[block_size/8];
+    const uint8_t* random_bytes = reinterpret_cast<const uint8_t*>(random_words);
+    char ascii[block_size];
+    const int end = max_size - 1; // leaving room for the closing quote
+    switch (valid_values_only ? no_fault : string_fault_chances.next(random_generator)) {
+    case invalid_utf8_fault:
+        offset += insert_invalid_utf8(&json[offset], end - offset, random_generator);
+        break;
+    case invalid_string_fault:
+        offset += insert_invalid_string(&json[offset], end - offset, random_generator);
+        break;
+    case invalid_codepoint_fault:
+        offset += insert_invalid_codepoint(&json[offset], end - offset, random_generator);
+        break;
+    }
+    bool closed = false;
+    while (!closed && offset < end) {
+        random_generator.fill(random_words, block_size/8);
+        uint32_t special = ascii_block(random_bytes, ascii);
+        int position = 0;
+        while (!closed && position < block_size && offset < end) {
+            // copying the ascii characters up to the next special position
+            int next_special = (special == 0) ? block_size : __builtin_ctz(special);
+            int run = std::min(next_special - position, end - offset);
+            std::memcpy(&json[offset], &ascii[position], run);
+            offset += run;
+            position += run;
+            if (position < next_special || next_special == block_size) {
                 continue;
             }
 
-            if (ujson[offset] == 0xf0) {
-                json[offset+1] = random_generator.next_ranged_int(0x90, 0xbf);
+            special &= special - 1;
+            int choice = random_bytes[position] & 0x0f;
+            position++;
+            if (choice == 0 && workload() != long_string_workload && profile == nullptr && !over_size) {
+                // Closing quote. The string is closing by itself.
+                json[offset] = '"';
+                offset++;
+                closed = true;
             }
-            else if (ujson[offset] == 0xf4) {
-                json[offset+1] = random_generator.next_ranged_int(0x80, 0x8f);
+            else if (choice == 1) {
+                offset += insert_escape_sequence(&json[offset], end - offset, random_generator);
+            }
+            else if (workload() == escape_heavy_workload && choice < 12) {
+                // about as many escape sequences as escaped surrogate pairs
+                if (choice < 7) {
+                    offset += insert_escape_sequence(&json[offset], end - offset, random_generator);
+                }
+                else {
+                    offset += insert_escaped_surrogate_pair(&json[offset], end - offset, random_generator);
+                }
             }
-            else { // 0xf1 >= ujson[offset] <= 0xf3
-                json[offset+1] = random_generator.next_ranged_int(0x80, 0xbf);
+            else if (Policy::unicode) {
+                offset += insert_utf8_character(&json[offset], end - offset, codepoint_sampler, random_generator);
             }
-
-            json[offset+2] = random_generator.next_ranged_int(0x80, 0xbf);
-            json[offset+3] = random_generator.next_ranged_int(0x80, 0xbf);
-            
-            offset += char_size;
-            continue;
         }
     }
 
@@ -547,12 +2246,15 @@ int RandomJson::insert_string(char* json, int max_size, RandomEngine& random_gen
 
     size = offset;
 
-    return offset;
+    return size;
 }
 
-int RandomJson::insert_array_entry(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_array_entry(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator)
 {
-    int comma_length = use_comma.top() ? 1: 0;
+    // An invalid comma is missing, or it comes before the first entry
+    const bool comma = nesting.needs_comma() != (invalid_comma_chances.next(random_generator) == 1);
+    int comma_length = comma ? 1 : 0;
     int size = 0;
     if (max_size < comma_length) {
         return size;
@@ -560,13 +2262,13 @@ int RandomJson::insert_array_entry(char* json, std::stack<char>& closing_stack,
 
     int offset = insert_whitespace(json, max_size, random_generator);
 
-    if (use_comma.top()) {
+    if (comma) {
         json[offset] = ',';
         offset++;
         offset += insert_whitespace(&json[offset], max_size-offset, random_generator);
     }
     
-    int value_size = insert_value(&json[offset], closing_stack, use_comma, max_size-offset, random_generator);
+    int value_size = insert_value(&json[offset], nesting, max_size-offset, random_generator);
 
     // We make sure a value has been successfully written
     // Otherwise, we make sure to overwrite the invalid comma we might have inserted
@@ -578,12 +2280,15 @@ int RandomJson::insert_array_entry(char* json, std::stack<char>& closing_stack,
     return size;
 }
 
-int RandomJson::insert_object_entry(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_object_entry(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator)
 {
     const int min_key_size = 2;
     const int colon_size = 1;
     const int min_value_size = 1;
-    int comma_length = use_comma.top() ? 1 : 0;
+    // An invalid comma is missing, or it comes before the first entry
+    const bool comma = nesting.needs_comma() != (invalid_comma_chances.next(random_generator) == 1);
+    int comma_length = comma ? 1 : 0;
     int min_size = min_key_size + colon_size + min_value_size + comma_length;
     int size = 0;
     if (min_size > max_size) {
@@ -593,7 +2298,7 @@ int RandomJson::insert_object_entry(char* json, std::stack<char>& closing_stack,
     int offset = insert_whitespace(json, max_size - min_size, random_generator);
 
     // Inserting comma before key if necessary
-    if (use_comma.top()) {
+    if (comma) {
         json[offset] = ',';
         offset++;
         min_size -= comma_length;
@@ -602,7 +2307,9 @@ int RandomJson::insert_object_entry(char* json, std::stack<char>& closing_stack,
     }
     // Inserting key
     min_size -= min_key_size;
-    int key_size = insert_string(&json[offset], max_size - offset - min_size, random_generator);
+    size_t recorded = nesting.recorded();
+    int key_size = insert_key(&json[offset], max_size - offset - min_size, random_generator);
+    nesting.record(&json[offset], key_size, structural_key);
     offset += key_size;
     // Inserting space after key and before colon
     offset += insert_whitespace(&json[offset], max_size - offset - min_size, random_generator);
@@ -613,11 +2320,12 @@ int RandomJson::insert_object_entry(char* json, std::stack<char>& closing_stack,
     // Inserting whitespace after colon and before value
     offset += insert_whitespace(&json[offset], max_size - offset - min_size, random_generator);
     // Inserting value
-    int value_size = insert_value(&json[offset], closing_stack, use_comma, max_size - offset, random_generator);
+    int value_size = insert_value(&json[offset], nesting, max_size - offset, random_generator);
 
     // Quick fix if we failed to write a value
     // This should not happen, but it actually happens frequently at the end of documents.
     if (value_size == 0) {
+        nesting.forget_since(recorded);
         return size;
     }
 
@@ -625,7 +2333,8 @@ int RandomJson::insert_object_entry(char* json, std::stack<char>& closing_stack,
     return size;
 }
 
-int RandomJson::insert_value(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_value(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator)
 {
     const int min_size = 1;
     int size = 0;
@@ -634,27 +2343,35 @@ int RandomJson::insert_value(char* json, std::stack<char>& closing_stack, std::s
         return size;
     }
 
-    // the number associated to the type is arbitrary
-    switch (random_generator.next_ranged_int(0, 3)) {
-    case 0:
-        size = init_object_or_array(json, closing_stack, use_comma, max_size, random_generator);
+    // The values of a profile depend on their depth
+    const AliasTable& chances = (profile == nullptr) ? value_chances
+                              : depth_value_chances[std::min(nesting.size(), depth_value_chances.size()-1)];
+    switch (chances.next(random_generator)) {
+    case object_value:
+        size = open_container(json, nesting, max_size, '}', random_generator);
         break;
-    case 1:
+    case array_value:
+        size = open_container(json, nesting, max_size, ']', random_generator);
+        break;
+    case string_value:
         size = insert_string(json, max_size, random_generator);
         if (size != 0) {
-            use_comma.top() = true;
+            nesting.set_comma();
+            nesting.record(json, size, structural_string);
         }
-    break;
-    case 2:
+        break;
+    case number_value:
         size = insert_number(json, max_size, random_generator);
         if (size != 0) {
-            use_comma.top() = true;
+            nesting.set_comma();
+            nesting.record(json, size, structural_number);
         }
         break;
-    case 3:
+    case literal_value:
         size = insert_true_false_or_null(json, max_size, random_generator);
         if (size != 0) {
-            use_comma.top() = true;
+            nesting.set_comma();
+            nesting.record(json, size, json[0] == 't' ? structural_true : (json[0] == 'f' ? structural_false : structural_null));
         }
         break;
     default:
@@ -665,7 +2382,15 @@ int RandomJson::insert_value(char* json, std::stack<char>& closing_stack, std::s
     return size;
 }
 
-int RandomJson::init_object_or_array(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::init_object_or_array(char* json, NestingStack& nesting, int max_size, RandomEngine& random_generator)
+{
+    const char closing_bracket = (container_chances.next(random_generator) == object_value) ? '}' : ']';
+    return open_container(json, nesting, max_size, closing_bracket, random_generator);
+}
+
+template <typename Policy>
+int BasicRandomJson<Policy>::open_container(char* json, NestingStack& nesting, int max_size, char closing_bracket, RandomEngine& random_generator)
 {
     const int min_size = 2;
     int size = 0;
@@ -673,39 +2398,43 @@ int RandomJson::init_object_or_array(char* json, std::stack<char>& closing_stack
         return size;
     }
 
-    if (closing_stack.size() >= settings.max_depth-2) {
+    const int64_t depth = static_cast<int64_t>(nesting.size());
+    if (depth >= nesting_limit()-2 || (depth >= max_depth()-2 && over_depth_chances.next(random_generator) == 0)) {
         return size;
     }
-    
-    if (random_generator.next_bool()) {
-        json[0] = '[';
-        closing_stack.push(']');
-    }
-    else {
-        json[0] = '{';
-        closing_stack.push('}');
-    }
+
+    json[0] = (closing_bracket == '}') ? '{' : '[';
+    nesting.push(closing_bracket);
+    nesting.record_open(json);
     size = 1;
-    use_comma.push(false);
 
     return size;
 }
 
-int RandomJson::randomly_close_bracket(char* json, std::stack<char>& closing_stack, std::stack<bool>& use_comma, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::randomly_close_bracket(char* json, NestingStack& nesting, RandomEngine& random_generator)
 {
-    const uint32_t magic_closer = 0x40000000;
+    // A container is closed one time out of four (one time out of 64 for deep nesting)
     int size = 0;
-    if (closing_stack.size() > 1 && magic_closer >= static_cast<uint32_t>(random_generator.next_int())) {
-        json[0] = closing_stack.top();
-        closing_stack.pop();
-        use_comma.pop();
-        use_comma.top() = true;
+    const int bits = (workload() == deep_nesting_workload) ? 6 : 2;
+    bool closing = false;
+    if (nesting.size() > 1) {
+        // The widths of the containers of a profile
+        closing = (profile != nullptr) ? random_generator.next_bits(16) < (nesting.top() == ']' ? array_closing : object_closing)
+                                       : random_generator.next_bits(bits) == 0;
+    }
+    if (closing) {
+        json[0] = nesting.top();
+        nesting.record_close(json);
+        nesting.pop();
+        nesting.set_comma();
         size = 1;
     }
     return size;
 }
 
-int RandomJson::insert_true_false_or_null(char* json, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_true_false_or_null(char* json, int max_size, RandomEngine& random_generator)
 {
     const int min_size = 4;
     int size = 0;
@@ -713,22 +2442,23 @@ int RandomJson::insert_true_false_or_null(char* json, int max_size, RandomEngine
         return size;
     }
 
-    switch (random_generator.next_ranged_int(0, max_size == 4 ? 1 : 2)) {
-    case 0:
+    // false doesn't fit in 4 bytes
+    switch (max_size == 4 ? short_literal_chances.next(random_generator) : literal_chances.next(random_generator)) {
+    case true_literal:
         json[0] = 't';
         json[1] = 'r';
         json[2] = 'u';
         json[3] = 'e';
         size = 4;
         break;
-    case 1:
+    case null_literal:
         json[0] = 'n';
         json[1] = 'u';
         json[2] = 'l';
         json[3] = 'l';
         size = 4;
         break;
-    case 2:
+    case false_literal:
         json[0] = 'f';
         json[1] = 'a';
         json[2] = 'l';
@@ -740,123 +2470,939 @@ int RandomJson::insert_true_false_or_null(char* json, int max_size, RandomEngine
     return size;
 }
 
-int RandomJson::insert_whitespace(char* json, int max_size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_whitespace(char* json, int max_size, RandomEngine& random_generator)
 {
     const int min_size = 0;
     int size = 0;
-    if (max_size < min_size) {
+    if (max_size < min_size || Policy::max_whitespace_size == 0) {
         return size;
     }
 
-    max_size = std::min(max_size, settings.max_whitespace_size);
-    size = random_generator.next_ranged_int(min_size, max_size);
-    insert_givensized_whitespace(json, size, random_generator);
-
-    return size;
+    if (over_whitespace_size_chances.next(random_generator) == 1 && max_size/2 > max_whitespace_size()) {
+        // Up to twice the maximum, and up to half of the room, so the rest of the entry still fits
+        size = random_generator.next_ranged_int(max_whitespace_size() + 1, std::min(max_size/2, 2*max_whitespace_size() + 1));
+        insert_givensized_whitespace(json, size, random_generator);
+        return size;
+    }
+    max_size = std::min(max_size, max_whitespace_size());
+    // At least half of the maximum for the whitespace-heavy workload
+    const int min_whitespace_size = (workload() == whitespace_heavy_workload) ? max_size / 2 : min_size;
+    if (profile != nullptr) {
+        size = static_cast<int>(std::min<int64_t>(profile_length(whitespace_length_chances, random_generator), max_size));
+    }
+    else {
+        size = random_generator.next_ranged_int(min_whitespace_size, max_size);
+    }
+    insert_givensized_whitespace(json, size, random_generator);
+
+    return size;
 }
 
-void RandomJson::insert_givensized_whitespace(char* json, int size, RandomEngine& random_generator)
+template <typename Policy>
+void BasicRandomJson<Policy>::insert_givensized_whitespace(char* json, int size, RandomEngine& random_generator)
 {
     const char whitespaces[] {0x09, 0x0A, 0x0D, 0x20};
+    // The records of NDJSON are on a single line
+    const char inline_whitespaces[] {0x09, 0x20, 0x09, 0x20};
+    const char* characters = settings.ndjson ? inline_whitespaces : whitespaces;
 
     for (int i = 0; i < size; i++) {
-        json[i] = whitespaces[random_generator.next_ranged_int(0, 3)];
+        json[i] = characters[random_generator.next_bits(2)];
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::reserve(int64_t size) {
+    const size_t alignment = std::max<size_t>(settings.alignment, 1);
+    const int64_t needed = size + settings.padding;
+    bool aligned = buffer_kind == caller_buffer || reinterpret_cast<uintptr_t>(json) % alignment == 0;
+    if (needed <= capacity && buffer_kind != mapped_buffer && aligned) {
+        return;
+    }
+    release();
+    allocation = new char[needed + alignment - 1];
+    json = allocation + (alignment - reinterpret_cast<uintptr_t>(allocation) % alignment) % alignment;
+    capacity = needed;
+    buffer_kind = owned_buffer;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::pad() {
+    if (buffer_kind != mapped_buffer && settings.padding > 0) {
+        std::memset(&json[settings.size], 0, settings.padding);
+    }
+}
+
+template <typename Policy>
+bool BasicRandomJson<Policy>::mapping_has_padding(int64_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+    // The end of the last page of a mapping is zeroed
+    int64_t page_size = sysconf(_SC_PAGESIZE);
+    return static_cast<int64_t>(settings.padding) <= (page_size - size % page_size) % page_size;
+#else
+    return false;
+#endif
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::release() {
+    switch (buffer_kind) {
+    case owned_buffer:
+        delete[] allocation;
+        break;
+    case caller_buffer:
+        break;
+    case mapped_buffer:
+#if defined(__unix__) || defined(__APPLE__)
+        munmap(json, capacity);
+#endif
+        break;
+    }
+    json = nullptr;
+    allocation = nullptr;
+    capacity = 0;
+    buffer_kind = owned_buffer;
+}
+
+template <typename Policy>
+bool BasicRandomJson<Policy>::map_output_file(const std::string& filepath, int64_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+    if (!mapping_has_padding(size)) {
+        return false;
+    }
+    int fd = open(filepath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    void* mapping = MAP_FAILED;
+    if (size > 0 && ftruncate(fd, size) == 0) {
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    release();
+    json = static_cast<char*>(mapping);
+    capacity = size;
+    buffer_kind = mapped_buffer;
+    return true;
+#else
+    return false;
+#endif
 }
 
-void RandomJson::generate() {
-    json = new char[settings.size];
+template <typename Policy>
+void BasicRandomJson<Policy>::generate() {
+    // The output file is written as the document is generated.
+    // If it can't be mapped, the document is generated in memory and saved after the mutations (see apply_mutations()).
+    bool output_mapped = settings.output_filepath != "" && map_output_file(settings.output_filepath, settings.size);
+    if (!output_mapped) {
+        reserve(settings.size);
+    }
     int offset = 0;
-    if (settings.bom) {
+    if (Policy::bom && (settings.bom || bom_chances.next(generation_random) == 1)) {
         offset = insert_BOM(json);
     }
-    generate_json(&json[offset], settings.size-offset, generation_random);
+    index.clear();
+    tokens_built = false;
+    clear_mutation_log();
+    nesting.index = records_structural_index() ? &index : nullptr;
+    nesting.index_base = json;
+    record_offsets.clear();
+    record_sizes.clear();
+    if (settings.ndjson) {
+        layout_records(offset, settings.size-offset, generation_random);
+        generate_records(&json[offset], generation_random);
+    }
+    else if (number_of_subtrees(settings.size-offset) > 1) {
+        generate_subtrees(&json[offset], settings.size-offset, generation_random);
+    }
+    else {
+        nesting.reset(nesting_limit());
+        generate_json(&json[offset], settings.size-offset, nesting, generation_random);
+    }
+    settings.filepath = "";
+    pad();
+}
+
+template <typename Policy>
+bool BasicRandomJson<Policy>::stream(const Sink& sink, size_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = default_chunk_size;
+    }
+    // A single step may write past the chunk, and the closing brackets are all written at once.
+    StreamWindow window(sink, chunk_size, max_entry_size() + nesting_limit() + 8);
+    int64_t size = settings.size;
+    if (Policy::bom && (settings.bom || bom_chances.next(generation_random) == 1)) {
+        int bom_size = insert_BOM(window.position());
+        window.commit(bom_size);
+        size -= bom_size;
+    }
+    record_offsets.clear();
+    record_sizes.clear();
+    if (settings.ndjson) {
+        stream_records(window, size, generation_random);
+    }
+    else if (number_of_subtrees(size) > 1) {
+        stream_subtrees(window, size, generation_random);
+    }
+    else {
+        nesting.reset(nesting_limit());
+        nesting.index = nullptr; // no index for streamed documents
+        stream_json(window, size, nesting, generation_random);
+    }
     settings.filepath = "";
+    return window.flush();
 }
 
-void RandomJson::load_file(const std::string& filepath) {
+template <typename Policy>
+void BasicRandomJson<Policy>::load_file(const std::string& filepath) {
     settings.filepath = filepath;
+    index.clear(); // only generated documents are indexed
+    record_offsets.clear();
+    record_sizes.clear();
+    tokens_built = false;
+    clear_mutation_log();
+#if defined(__unix__) || defined(__APPLE__)
+    // The file is mapped instead of being read. The mapping is private (copy-on-write),
+    // so the mutations are possible and they are never written to the file.
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat file_stat;
+        void* mapping = MAP_FAILED;
+        if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0 && mapping_has_padding(file_stat.st_size)) {
+            mapping = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapping != MAP_FAILED) {
+            release();
+            json = static_cast<char*>(mapping);
+            capacity = file_stat.st_size;
+            buffer_kind = mapped_buffer;
+            settings.size = file_stat.st_size;
+            return;
+        }
+    }
+#endif
     std::ifstream file (filepath, std::ios::in | std::ios::binary | std::ios::ate);
     settings.size = file.tellg();
-    json = new char[settings.size];
+    reserve(settings.size);
     file.seekg(0, std::ios::beg);
     file.read(json, settings.size);
     file.close();
+    pad();
+}
+
+template <typename Policy>
+int BasicRandomJson<Policy>::max_entry_size()
+{
+    // whitespaces around the comma, the key and the colon, a key, a value, and some room for the numbers and the closing bracket
+    return 4*max_whitespace_size() + 2*max_string_size() + 64;
 }
 
-void RandomJson::generate_json(char* json, int size, RandomEngine& random_generator)
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_entry(char* json, NestingStack& nesting, int64_t space_left, RandomEngine& random_generator)
+{
+    int max_size = static_cast<int>(std::min<int64_t>(space_left, max_entry_size()));
+    int offset = randomly_close_bracket(json, nesting, random_generator);
+    max_size -= offset;
+    switch (nesting.top()) {
+    case ']' :
+        offset += insert_array_entry(&json[offset], nesting, max_size, random_generator);
+        break;
+    case '}':
+        offset += insert_object_entry(&json[offset], nesting, max_size, random_generator);
+        break;
+    }
+    return offset;
+}
+
+template <typename Policy>
+int BasicRandomJson<Policy>::close_everything(char* json, NestingStack& nesting, int64_t size, RandomEngine& random_generator)
 {
     int offset = 0;
-    std::stack<char> closing_stack; // Used to keep track of the structure we're in
-    std::stack<bool> use_comma; // Used to keep track if a comma is necessary or not
+    while (!nesting.empty()) {
+        json[offset] = nesting.top();
+        nesting.record_close(&json[offset]);
+        nesting.pop();
+        offset++;
+    }
+    insert_givensized_whitespace(&json[offset], size-offset, random_generator);
+    return static_cast<int>(size);
+}
+
+// The nesting stack is used to keep track of the structure we're in, and if a comma is necessary or not. It must be empty.
+template <typename Policy>
+void BasicRandomJson<Policy>::generate_json(char* json, int64_t size, NestingStack& nesting, RandomEngine& random_generator)
+{
+    int64_t offset = 0;
 
-    offset += insert_whitespace(&json[offset], size, random_generator);
-    offset += init_object_or_array(&json[offset], closing_stack,  use_comma, size-offset, random_generator);
+    offset += insert_whitespace(&json[offset], std::min<int64_t>(size, max_entry_size()), random_generator);
+    offset += init_object_or_array(&json[offset], nesting, std::min<int64_t>(size-offset, max_entry_size()), random_generator);
     while (true) {
         if (offset >= size) {
             break;
         }
-        int space_left = size-offset-closing_stack.size();
+        int64_t space_left = size-offset-nesting.size();
         if (space_left-5 <= 0) {
             // closing everything left
-            while (!closing_stack.empty()) {
-                json[offset] = closing_stack.top();
-                closing_stack.pop();
-                offset++;
-            }
-            insert_givensized_whitespace(&json[offset], size-offset, random_generator);
+            offset += close_everything(&json[offset], nesting, size-offset, random_generator);
             break;
         }
         else if (space_left < 0) {
             // There's a problem. What we do ?
         }
-        int closing_offset = randomly_close_bracket(&json[offset], closing_stack, use_comma, random_generator);
-        offset += closing_offset;
-        space_left -= closing_offset;
-        switch (closing_stack.top()) {
-        case ']' :
-            offset += insert_array_entry(&json[offset], closing_stack, use_comma, space_left, random_generator);
+        offset += insert_entry(&json[offset], nesting, space_left, random_generator);
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::stream_json(StreamWindow& window, int64_t size, NestingStack& nesting, RandomEngine& random_generator)
+{
+    // Same steps as generate_json(), but written through the window
+    const int64_t start = window.get_committed();
+
+    window.commit(insert_whitespace(window.position(), std::min<int64_t>(size, max_entry_size()), random_generator));
+    int64_t offset = window.get_committed() - start;
+    window.commit(init_object_or_array(window.position(), nesting, std::min<int64_t>(size-offset, max_entry_size()), random_generator));
+    while (true) {
+        offset = window.get_committed() - start;
+        if (offset >= size) {
             break;
-        case '}':
-            offset += insert_object_entry(&json[offset], closing_stack, use_comma, space_left, random_generator);
+        }
+        int64_t space_left = size-offset-nesting.size();
+        if (space_left-5 <= 0) {
+            window.commit(close_everything(window.position(), nesting, size-offset, random_generator));
             break;
         }
+        window.commit(insert_entry(window.position(), nesting, space_left, random_generator));
+    }
+}
+
+template <typename Policy>
+int64_t BasicRandomJson<Policy>::number_of_subtrees(int64_t size)
+{
+    if (settings.subtree_size <= 0) {
+        return 1;
+    }
+    // A subtree must at least have room for a key and a small value
+    int64_t subtree_size = std::max<int64_t>(settings.subtree_size, max_entry_size());
+    return std::max<int64_t>(size / subtree_size, 1);
+}
+
+template <typename Policy>
+int BasicRandomJson<Policy>::insert_subtree_key(char* json, int64_t size, RandomEngine& random_generator)
+{
+    // leaving enough room for the whitespaces and a container after the colon
+    int max_key_size = static_cast<int>(std::min<int64_t>(size - 2*max_whitespace_size() - 8, max_entry_size()));
+    int offset = insert_string(json, max_key_size, random_generator);
+    json[offset] = ':';
+    offset++;
+    return offset;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::generate_subtree(char* json, int64_t size, bool in_object, uint64_t seed, uint64_t stream, NestingStack& nesting)
+{
+    RandomEngine random_generator;
+    random_generator.seed(seed, stream);
+    int64_t offset = 0;
+    nesting.reset(nesting_limit());
+    if (in_object) {
+        offset = insert_subtree_key(json, size, random_generator);
+        // without the colon
+        nesting.record(json, offset-1, structural_key);
+    }
+    generate_json(&json[offset], size-offset, nesting, random_generator);
+}
+
+template <typename Policy>
+int64_t BasicRandomJson<Policy>::prepare_workers(int64_t parts)
+{
+    int64_t threads = settings.threads == 0 ? std::thread::hardware_concurrency() : settings.threads;
+    threads = std::max<int64_t>(std::min(threads, parts), 1);
+    // The stacks are kept for the next documents, so a reloaded document doesn't allocate them again
+    if (static_cast<int64_t>(worker_nestings.size()) < threads) {
+        worker_nestings.resize(threads, NestingStack(nesting_limit()));
+    }
+    for (int64_t t = 0; t < threads; t++) {
+        worker_nestings[t].reset(nesting_limit());
     }
+    return threads;
 }
 
-void RandomJson::mutate() {
+template <typename Policy>
+void BasicRandomJson<Policy>::generate_subtrees(char* json, int64_t size, RandomEngine& random_generator)
+{
+    // The layout only depends on the size and the random generator, not on the number of threads.
+    // Each subtree uses its own stream of the seed.
+    const int64_t subtrees = number_of_subtrees(size);
+    const bool is_array = container_chances.next(random_generator) == array_value;
+    const uint64_t seed = random_generator.get_seed();
+
+    // The subtrees share what is left once the brackets and the commas are inserted.
+    const int64_t content_size = size - 2 - (subtrees-1);
+    const int64_t subtree_size = content_size / subtrees;
+    const int64_t bigger_subtrees = content_size % subtrees;
+    auto subtree_offset = [&](int64_t i) {
+        return 1 + i*subtree_size + std::min(i, bigger_subtrees) + i;
+    };
+
+    json[0] = is_array ? '[' : '{';
+    json[size-1] = is_array ? ']' : '}';
+    for (int64_t i = 1; i < subtrees; i++) {
+        json[subtree_offset(i)-1] = ',';
+    }
+
+    // Each subtree has its own index. They are put together at the end.
+    const bool indexed = records_structural_index();
+    if (indexed && static_cast<int64_t>(subtree_indexes.size()) < subtrees) {
+        subtree_indexes.resize(subtrees);
+    }
+
+    std::atomic<int64_t> next_subtree(0);
+    auto worker = [&](int64_t t) {
+        NestingStack& nesting = worker_nestings[t];
+        nesting.index_base = this->json;
+        int64_t i;
+        while ((i = next_subtree++) < subtrees) {
+            int64_t size_i = subtree_size + (i < bigger_subtrees ? 1 : 0);
+            if (indexed) {
+                subtree_indexes[i].clear();
+            }
+            nesting.index = indexed ? &subtree_indexes[i] : nullptr;
+            generate_subtree(&json[subtree_offset(i)], size_i, !is_array, seed, i+1, nesting);
+        }
+    };
+    const int64_t threads = prepare_workers(subtrees);
+    std::vector<std::thread> pool;
+    for (int64_t t = 1; t < threads; t++) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    if (indexed) {
+        index.add(json - this->json, size, is_array ? structural_array : structural_object, 0);
+        for (int64_t i = 0; i < subtrees; i++) {
+            index.append(subtree_indexes[i], 1);
+        }
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::layout_records(int64_t first_offset, int64_t size, RandomEngine& random_generator)
+{
+    int64_t offset = 0;
+    while (offset < size) {
+        int64_t gap, record_size;
+        layout_record(offset, size, gap, record_size, random_generator);
+        record_offsets.push_back(first_offset + offset + gap);
+        record_sizes.push_back(record_size);
+        offset += gap + record_size + 1;
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::layout_record(int64_t offset, int64_t size, int64_t& gap, int64_t& record_size, RandomEngine& random_generator)
+{
+    // A record must leave room for a container after its first whitespaces
+    const int64_t min_record_size = std::max<int64_t>(settings.min_record_size, max_whitespace_size() + 8);
+    const int64_t max_record_size = std::max(settings.max_record_size, min_record_size);
+    const int64_t max_gap = 4;
+    // the blank lines (and their newlines) before the record
+    gap = 0;
+    if (settings.stray_lines && random_generator.next_bits(3) == 0) {
+        gap = random_generator.next_ranged_int64(1, max_gap);
+    }
+    record_size = random_generator.next_ranged_int64(min_record_size, max_record_size);
+    const int64_t remaining = size - offset;
+    if (remaining - (gap + record_size + 1) < max_gap + min_record_size + 1) {
+        // The last record takes what is left, or it is left alone if there is not enough room for the gap
+        if (remaining - gap - 1 < min_record_size) {
+            gap = 0;
+        }
+        record_size = remaining - gap - 1;
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::generate_record(char* json, int64_t gap, int64_t size, uint64_t seed, uint64_t stream, NestingStack& nesting)
+{
+    RandomEngine random_generator;
+    random_generator.seed(seed, stream);
+    if (gap > 0) {
+        insert_givensized_whitespace(json, static_cast<int>(gap-1), random_generator);
+        json[gap-1] = '\n';
+    }
+    if (size > 0) {
+        nesting.reset(nesting_limit());
+        generate_json(&json[gap], size, nesting, random_generator);
+    }
+    json[gap + size] = '\n';
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::generate_records(char* json, RandomEngine& random_generator)
+{
+    // Like the subtrees, each record uses its own stream of the seed
+    const uint64_t seed = random_generator.get_seed();
+    const int64_t records = record_offsets.size();
+    const int64_t first_start = json - this->json;
+
+    // Each record has its own index, like the subtrees. The records are top-level values.
+    const bool indexed = records_structural_index();
+    if (indexed && static_cast<int64_t>(subtree_indexes.size()) < records) {
+        subtree_indexes.resize(records);
+    }
+
+    std::atomic<int64_t> next_record(0);
+    auto worker = [&](int64_t t) {
+        NestingStack& nesting = worker_nestings[t];
+        nesting.index_base = this->json;
+        int64_t i;
+        while ((i = next_record++) < records) {
+            if (indexed) {
+                subtree_indexes[i].clear();
+            }
+            nesting.index = indexed ? &subtree_indexes[i] : nullptr;
+            // The record is preceded by its gap, which follows the newline of the previous record
+            const int64_t start = (i == 0) ? first_start : record_offsets[i-1] + record_sizes[i-1] + 1;
+            generate_record(&this->json[start], record_offsets[i] - start, record_sizes[i], seed, i+1, nesting);
+        }
+    };
+    const int64_t threads = prepare_workers(records);
+    std::vector<std::thread> pool;
+    for (int64_t t = 1; t < threads; t++) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+
+    if (indexed) {
+        for (int64_t i = 0; i < records; i++) {
+            index.append(subtree_indexes[i], 0);
+        }
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::stream_records(StreamWindow& window, int64_t size, RandomEngine& random_generator)
+{
+    // Same records as generate_records(), streamed one after the other.
+    // The layout draws come from random_generator and the records from their own streams, as in memory.
+    const uint64_t seed = random_generator.get_seed();
+    const int64_t first_offset = window.get_committed();
+    NestingStack nesting(nesting_limit());
+    int64_t offset = 0;
+    for (uint64_t i = 0; offset < size; i++) {
+        int64_t gap, record_size;
+        layout_record(offset, size, gap, record_size, random_generator);
+        if (settings.stream_record_offsets) {
+            record_offsets.push_back(first_offset + offset + gap);
+            record_sizes.push_back(record_size);
+        }
+        offset += gap + record_size + 1;
+        RandomEngine record_random;
+        record_random.seed(seed, i+1);
+        if (gap > 0) {
+            insert_givensized_whitespace(window.position(), static_cast<int>(gap-1), record_random);
+            window.position()[gap-1] = '\n';
+            window.commit(gap);
+        }
+        if (record_size > 0) {
+            nesting.reset(nesting_limit());
+            stream_json(window, record_size, nesting, record_random);
+        }
+        window.position()[0] = '\n';
+        window.commit(1);
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::stream_subtrees(StreamWindow& window, int64_t size, RandomEngine& random_generator)
+{
+    // Same layout as generate_subtrees(), streamed one subtree after the other
+    const int64_t subtrees = number_of_subtrees(size);
+    const bool is_array = container_chances.next(random_generator) == array_value;
+    const uint64_t seed = random_generator.get_seed();
+    const int64_t content_size = size - 2 - (subtrees-1);
+    const int64_t subtree_size = content_size / subtrees;
+    const int64_t bigger_subtrees = content_size % subtrees;
+    NestingStack nesting(nesting_limit()); // no index for streamed documents
+
+    window.position()[0] = is_array ? '[' : '{';
+    window.commit(1);
+    for (int64_t i = 0; i < subtrees; i++) {
+        if (i > 0) {
+            window.position()[0] = ',';
+            window.commit(1);
+        }
+        int64_t size_i = subtree_size + (i < bigger_subtrees ? 1 : 0);
+        RandomEngine subtree_random;
+        subtree_random.seed(seed, i+1);
+        if (!is_array) {
+            int key_size = insert_subtree_key(window.position(), size_i, subtree_random);
+            window.commit(key_size);
+            size_i -= key_size;
+        }
+        nesting.reset(nesting_limit());
+        stream_json(window, size_i, nesting, subtree_random);
+    }
+    window.position()[0] = is_array ? ']' : '}';
+    window.commit(1);
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::mutate() {
+    // The undone mutations can't be redone anymore
+    if (applied_mutations < mutation_log.size()) {
+        saved_bytes.resize(mutation_log[applied_mutations].first_byte);
+        mutation_log.resize(applied_mutations);
+    }
+    LoggedMutation logged_mutation = {saved_bytes.size(), settings.number_of_mutations, -1, {0, 0}, {0, 0}};
+    mutation_log.push_back(logged_mutation);
+    applied_mutations++;
+
+    // Each mutation starts at its own position of the random generator, so its draws are the same whether the ones
+    // before it are skipped or not. A mutation never takes 2^32 draws.
+    mutation_random.seek(static_cast<uint64_t>(settings.number_of_mutations) << 32);
+
+    int total = 0;
+    for (int weight : settings.mutation_weights) {
+        total += std::max(weight, 0);
+    }
+    MutationType type = byte_mutation;
+    if (total > 0) {
+        int random_weight = mutation_random.next_ranged_int(0, total-1);
+        int i = 0;
+        while (random_weight >= std::max(settings.mutation_weights[i], 0)) {
+            random_weight -= std::max(settings.mutation_weights[i], 0);
+            i++;
+        }
+        type = static_cast<MutationType>(i);
+    }
+
+    switch (type) {
+    case byte_mutation:
+        mutate_byte();
+        break;
+    case value_mutation:
+        // Nothing changes in a document without value (or without index, like a loaded document).
+        mutate_value();
+        break;
+    default:
+        mutate_token(type);
+    }
+    settings.number_of_mutations++;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::mutate_byte() {
     const int bytes_to_change = 1;
 
-    saved_bytes.clear();
     for (int i = 0; i < bytes_to_change; i++) {
-        int random_position = mutation_random.next_ranged_int(0, settings.size-1);
-        char previous_value = json[random_position];
-        json[random_position] = mutation_random.next_char();
-        SavedByte saved_byte { random_position, previous_value};
+        int64_t random_position = mutation_random.next_ranged_int64(0, settings.size-1);
+        replace_byte(random_position, mutation_random.next_char());
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::mutate_value() {
+    // Looking for a value that is not a container (nor a key). Most entries are.
+    const int max_tries = 64;
+    int64_t entry = -1;
+    for (int i = 0; i < max_tries && index.size() != 0; i++) {
+        int64_t candidate = mutation_random.next_ranged_int64(0, index.size()-1);
+        if (index.types[candidate] >= structural_string) {
+            entry = candidate;
+            break;
+        }
+    }
+    if (entry == -1) {
+        return;
+    }
+
+    const int64_t offset = index.offsets[entry];
+    const int length = static_cast<int>(index.lengths[entry]);
+    const size_t first_byte = saved_bytes.size();
+    for (int i = 0; i < length; i++) {
+        SavedByte saved_byte { offset + i, json[offset + i], 0};
         saved_bytes.push_back(saved_byte);
     }
-    settings.number_of_mutations++;
+
+    // The new value is followed by whitespaces up to the size of the old one.
+    // Some values don't fit in some sizes (a literal in 3 bytes, for instance), then the next kind of value is tried.
+    // An integer always fits.
+    char* value = &json[offset];
+    int size = 0;
+    StructuralType type = structural_string;
+    valid_values_only = true;
+    int kind = mutation_random.next_ranged_int(0, 2);
+    for (int i = 0; i < 3 && size == 0; i++, kind = (kind+1) % 3) {
+        switch (kind) {
+        case 0:
+            size = insert_string(value, length, mutation_random);
+            type = structural_string;
+            break;
+        case 1:
+            size = insert_number(value, length, mutation_random);
+            type = structural_number;
+            break;
+        case 2:
+            size = insert_true_false_or_null(value, length, mutation_random);
+            type = value[0] == 't' ? structural_true : (value[0] == 'f' ? structural_false : structural_null);
+            break;
+        }
+    }
+    if (size == 0) {
+        size = insert_integer(value, length, mutation_random);
+        type = structural_number;
+    }
+    insert_givensized_whitespace(&value[size], length - size, mutation_random);
+    valid_values_only = false;
+    for (int i = 0; i < length; i++) {
+        saved_bytes[first_byte + i].after = value[i];
+    }
+
+    LoggedMutation& logged_mutation = mutation_log.back();
+    logged_mutation.entry = entry;
+    logged_mutation.lengths[0] = index.lengths[entry];
+    logged_mutation.types[0] = index.types[entry];
+    logged_mutation.lengths[1] = size;
+    logged_mutation.types[1] = type;
+    index.lengths[entry] = size;
+    index.types[entry] = type;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::replace_byte(int64_t position, char value) {
+    SavedByte saved_byte { position, json[position], value};
+    saved_bytes.push_back(saved_byte);
+    json[position] = value;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::mutate_token(MutationType type) {
+    if (!tokens_built) {
+        tokens.build(json, settings.size);
+        tokens_built = true;
+    }
+    // The positions were found before the previous mutations. A position that has been changed is still used.
+    const std::vector<int64_t>* candidates = nullptr;
+    switch (type) {
+    case drop_comma: case duplicate_comma: candidates = &tokens.commas; break;
+    case swap_brackets: candidates = &tokens.brackets; break;
+    case cut_string: case control_character: candidates = &tokens.string_starts; break;
+    case broken_surrogate: candidates = &tokens.low_surrogates; break;
+    case extra_exponent_sign: candidates = &tokens.exponents; break;
+    default: break;
+    }
+    if (candidates == nullptr || candidates->empty()) {
+        mutate_byte();
+        return;
+    }
+
+    // The mutation only breaks its own token: a duplicate comma takes the place of a whitespace next to the comma,
+    // and the signs of an exponent take the place of its sign or its digits. Another candidate is tried otherwise.
+    auto is_whitespace = [&](int64_t i) {
+        return 0 <= i && i < settings.size && (json[i] == ' ' || json[i] == '\t' || json[i] == '\n' || json[i] == '\r');
+    };
+    auto is_digit = [&](int64_t i) {
+        return i < settings.size && json[i] >= '0' && json[i] <= '9';
+    };
+    auto fits = [&](int64_t position) -> bool {
+        switch (type) {
+        case duplicate_comma:
+            return is_whitespace(position + 1) || is_whitespace(position - 1);
+        case extra_exponent_sign: {
+            const bool has_sign = position + 1 < settings.size && (json[position + 1] == '+' || json[position + 1] == '-');
+            return (has_sign || is_digit(position + 1)) && is_digit(position + 2);
+        }
+        default:
+            return true;
+        }
+    };
+    const int max_tries = 64;
+    int64_t candidate = -1;
+    for (int i = 0; i < max_tries && candidate == -1; i++) {
+        const int64_t drawn = mutation_random.next_ranged_int64(0, candidates->size()-1);
+        if (fits((*candidates)[drawn])) {
+            candidate = drawn;
+        }
+    }
+    if (candidate == -1) {
+        mutate_byte();
+        return;
+    }
+    int64_t position = (*candidates)[candidate];
+
+    switch (type) {
+    case drop_comma:
+        replace_byte(position, ' ');
+        break;
+    case duplicate_comma:
+        // The whitespace following the comma is replaced, or else the one preceding it
+        replace_byte(is_whitespace(position + 1) ? position + 1 : position - 1, ',');
+        break;
+    case swap_brackets: {
+        const char bracket = json[position];
+        replace_byte(position, bracket == '[' ? '{' : (bracket == '{' ? '[' : (bracket == ']' ? '}' : ']')));
+        break;
+    }
+    case cut_string: {
+        // The closing quote is put anywhere inside the string. The rest of the string stays there.
+        const int64_t end = tokens.string_ends[candidate];
+        if (end - position > 1) {
+            replace_byte(mutation_random.next_ranged_int64(position+1, end-1), '"');
+        }
+        break;
+    }
+    case control_character: {
+        // Replaces a byte between the quotes (or the closing quote of an empty string)
+        const int64_t end = tokens.string_ends[candidate];
+        replace_byte(mutation_random.next_ranged_int64(position+1, std::max(position+1, end-1)), static_cast<char>(mutation_random.next_bits(5)));
+        break;
+    }
+    case broken_surrogate:
+        // \uDCxx becomes a character that is not a surrogate, and \uD8xx is left without its second half
+        replace_byte(position, static_cast<char>('0' + mutation_random.next_ranged_int(0, 9)));
+        break;
+    case extra_exponent_sign:
+        // The exponent gets two signs in a row, which is never a valid number. The signs overwrite the first digits:
+        // 1e+52 becomes 1e+-2 or 1e++2, and 1e52 becomes 1e+-, 1e-+, 1e++ or 1e--
+        position++;
+        if (json[position] != '+' && json[position] != '-') {
+            replace_byte(position, mutation_random.next_bool() ? '+' : '-');
+        }
+        replace_byte(position + 1, mutation_random.next_bool() ? '+' : '-');
+        break;
+    default:
+        break;
+    }
 }
 
-void RandomJson::reverse_mutation() {
-    for (SavedByte saved_byte : saved_bytes) {
-        json[saved_byte.position] = saved_byte.value;
+template <typename Policy>
+void BasicRandomJson<Policy>::apply_logged_mutation(size_t mutation, bool after) {
+    const LoggedMutation& logged_mutation = mutation_log[mutation];
+    const size_t end = (mutation+1 < mutation_log.size()) ? mutation_log[mutation+1].first_byte : saved_bytes.size();
+    if (after) {
+        for (size_t i = logged_mutation.first_byte; i < end; i++) {
+            json[saved_bytes[i].position] = saved_bytes[i].after;
+        }
     }
+    else {
+        // backward, in case a byte was changed twice
+        for (size_t i = end; i > logged_mutation.first_byte; i--) {
+            json[saved_bytes[i-1].position] = saved_bytes[i-1].before;
+        }
+    }
+    if (logged_mutation.entry != -1) {
+        index.lengths[logged_mutation.entry] = logged_mutation.lengths[after];
+        index.types[logged_mutation.entry] = logged_mutation.types[after];
+    }
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::clear_mutation_log() {
     saved_bytes.clear();
+    mutation_log.clear();
+    applied_mutations = 0;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::apply_mutations(int number_of_mutations) {
+    // mutate() counts the mutations, and the skipped ones are counted too
+    settings.number_of_mutations = 0;
+    std::sort(settings.skipped_mutations.begin(), settings.skipped_mutations.end());
+    std::vector<int>::const_iterator skipped = settings.skipped_mutations.begin();
+    for (int i = 0; i < number_of_mutations; i++) {
+        while (skipped != settings.skipped_mutations.end() && *skipped < i) {
+            ++skipped;
+        }
+        if (skipped != settings.skipped_mutations.end() && *skipped == i) {
+            settings.number_of_mutations++;
+            continue;
+        }
+        mutate();
+    }
+    // The output file holds the mutated document, whether it is mapped or not
+    if (settings.output_filepath != "" && settings.filepath == "") {
+        save(settings.output_filepath);
+    }
+}
+
+template <typename Policy>
+std::vector<MutatedByte> BasicRandomJson<Policy>::get_mutations() {
+    std::vector<MutatedByte> mutations;
+    for (size_t mutation = 0; mutation < applied_mutations; mutation++) {
+        const size_t end = (mutation+1 < mutation_log.size()) ? mutation_log[mutation+1].first_byte : saved_bytes.size();
+        for (size_t i = mutation_log[mutation].first_byte; i < end; i++) {
+            MutatedByte mutated_byte = {mutation_log[mutation].number, saved_bytes[i].position, saved_bytes[i].before, saved_bytes[i].after};
+            mutations.push_back(mutated_byte);
+        }
+    }
+    return mutations;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::reverse_mutation() {
+    if (applied_mutations == 0) {
+        return;
+    }
+    applied_mutations--;
+    apply_logged_mutation(applied_mutations, false);
+}
+
+template <typename Policy>
+bool BasicRandomJson<Policy>::redo_mutation() {
+    if (applied_mutations == mutation_log.size()) {
+        return false;
+    }
+    apply_logged_mutation(applied_mutations, true);
+    applied_mutations++;
+    return true;
 }
 
-void RandomJson::save(std::string file_name)
+template <typename Policy>
+typename BasicRandomJson<Policy>::Checkpoint BasicRandomJson<Policy>::checkpoint() {
+    return applied_mutations;
+}
+
+template <typename Policy>
+void BasicRandomJson<Policy>::rollback_to(Checkpoint checkpoint) {
+    while (applied_mutations > checkpoint) {
+        reverse_mutation();
+    }
+    while (applied_mutations < checkpoint && redo_mutation()) {
+    }
+}
+
+template <typename Policy>
+bool BasicRandomJson<Policy>::save(std::string file_name)
 {
+    if (buffer_kind == mapped_buffer && file_name == settings.output_filepath && settings.filepath == "") {
+        // The document is already in the file
+        return true;
+    }
     std::fstream file(file_name, std::ios::out | std::ios::binary);
     file.write(json, sizeof(char)*settings.size);
     file.close();
+    return !file.fail();
 }
 
-void RandomJson::load_settings(const Settings& new_settings) {
+template <typename Policy>
+void BasicRandomJson<Policy>::load_settings(const Settings& new_settings) {
     settings = new_settings;
-    // TODO: Find an intelligent way to reallocate memory only if necessary
-    delete[] json;
     generation_random.seed(settings.generation_seed);
+    codepoint_sampler.load(settings.unicode_weights);
+    load_chances();
     mutation_random.seed(settings.mutation_seed);
     if (settings.filepath != "") {
         load_file(settings.filepath);
@@ -865,50 +3411,484 @@ void RandomJson::load_settings(const Settings& new_settings) {
         generate();
     }
 
-    for (int i = 0; i < settings.number_of_mutations; i++) {
-        mutate();
-    }
+    apply_mutations(settings.number_of_mutations);
+}
+
+template <typename Policy>
+bool BasicRandomJson<Policy>::stream(const Settings& new_settings, const Sink& sink, size_t chunk_size) {
+    settings = new_settings;
+    generation_random.seed(settings.generation_seed);
+    codepoint_sampler.load(settings.unicode_weights);
+    load_chances();
+    mutation_random.seed(settings.mutation_seed);
+    release();
+    index.clear();
+    tokens_built = false;
+    clear_mutation_log();
+    return stream(sink, chunk_size);
 }
 
 /*
 ** Getters
 */
-const char* RandomJson::get_json()
+template <typename Policy>
+const char* BasicRandomJson<Policy>::get_json()
 {
     return json;
 }
 
-int RandomJson::get_size()
+template <typename Policy>
+int64_t BasicRandomJson<Policy>::get_size()
 {
     return settings.size;
 }
 
-int RandomJson::get_number_of_mutations()
+template <typename Policy>
+int BasicRandomJson<Policy>::get_number_of_mutations()
 {
     return settings.number_of_mutations;
 }
 
 // The generation seed has no meaning if the json is from a file
-int RandomJson::get_generation_seed()
+template <typename Policy>
+uint64_t BasicRandomJson<Policy>::get_generation_seed()
 {
     return settings.generation_seed;
 }
 
-int RandomJson::get_mutation_seed()
+template <typename Policy>
+uint64_t BasicRandomJson<Policy>::get_mutation_seed()
 {
     return settings.mutation_seed;
 }
 
-bool RandomJson::is_from_file()
+template <typename Policy>
+bool BasicRandomJson<Policy>::is_from_file()
 {
     return settings.filepath != "";
 }
 
-std::string RandomJson::get_filepath()
+template <typename Policy>
+bool BasicRandomJson<Policy>::records_structural_index()
+{
+    return settings.structural_index || settings.mutation_weights[value_mutation] > 0;
+}
+
+template <typename Policy>
+const std::vector<int64_t>& BasicRandomJson<Policy>::get_record_offsets()
+{
+    return record_offsets;
+}
+
+template <typename Policy>
+const std::vector<int64_t>& BasicRandomJson<Policy>::get_record_sizes()
+{
+    return record_sizes;
+}
+
+template <typename Policy>
+const StructuralIndex& BasicRandomJson<Policy>::get_structural_index()
+{
+    return index;
+}
+
+template <typename Policy>
+std::string BasicRandomJson<Policy>::get_filepath()
 {
     return settings.filepath;
 }
 
+// Lock-free queue of indexes between one producer thread and one consumer thread.
+// A thread that has to wait for the other one sleeps on a condition variable (see RandomJsonProducer).
+class IndexRing {
+    public:
+    IndexRing(size_t capacity) : indexes(capacity) {}
+    // Returns false if the ring is full
+    bool push(size_t index) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == indexes.size()) {
+            return false;
+        }
+        indexes[tail % indexes.size()] = index;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    // Returns false if the ring is empty
+    bool pop(size_t& index) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        index = indexes[head % indexes.size()];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    private:
+    std::vector<size_t> indexes;
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+// Generates documents on a background thread while the consumer uses the previous ones.
+// Up to queue_size documents are generated ahead, each in its own RandomJson, whose buffer is reused.
+// The n-th document (from 0) uses the seeds of the settings plus n, and its RandomJson keeps them.
+class RandomJsonProducer {
+    public:
+    RandomJsonProducer(const Settings& settings, size_t queue_size = 2);
+    // Stops the generation. The documents that were not consumed are lost.
+    ~RandomJsonProducer();
+
+    // Waits for the next document. It is valid (and it can be mutated) until the following call.
+    RandomJson& next();
+
+    private:
+    void produce();
+    // Pushes an index in a ring and wakes up the thread waiting for it
+    void push(IndexRing& ring, std::condition_variable& pushed, size_t index);
+    // Sleeps until an index can be popped from a ring. Returns false if the producer is stopping.
+    bool pop(IndexRing& ring, std::condition_variable& pushed, size_t& index);
+
+    Settings settings;
+    // queue_size documents waiting for the consumer, and the one it uses
+    std::vector<std::unique_ptr<RandomJson> > documents;
+    IndexRing generated; // from the producer to the consumer
+    IndexRing recycled; // from the consumer to the producer
+    size_t consumed = SIZE_MAX; // document used by the consumer
+    std::atomic<bool> stopping{false};
+    // Only used to sleep: the rings are read and written without it
+    std::mutex waiting;
+    std::condition_variable generated_pushed;
+    std::condition_variable recycled_pushed;
+    std::thread producer;
+};
+
+RandomJsonProducer::RandomJsonProducer(const Settings& settings, size_t queue_size)
+: settings(settings)
+, documents(std::max<size_t>(queue_size, 1) + 1)
+, generated(documents.size())
+, recycled(documents.size())
+{
+    for (size_t i = 0; i < documents.size(); i++) {
+        recycled.push(i);
+    }
+    producer = std::thread(&RandomJsonProducer::produce, this);
+}
+
+RandomJsonProducer::~RandomJsonProducer()
+{
+    {
+        std::lock_guard<std::mutex> lock(waiting);
+        stopping.store(true, std::memory_order_relaxed);
+    }
+    recycled_pushed.notify_one();
+    producer.join();
+}
+
+void RandomJsonProducer::push(IndexRing& ring, std::condition_variable& pushed, size_t index)
+{
+    ring.push(index);
+    // Taking the lock makes sure the other thread either sees the index or is already asleep
+    {
+        std::lock_guard<std::mutex> lock(waiting);
+    }
+    pushed.notify_one();
+}
+
+bool RandomJsonProducer::pop(IndexRing& ring, std::condition_variable& pushed, size_t& index)
+{
+    if (ring.pop(index)) {
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(waiting);
+    bool popped = false;
+    pushed.wait(lock, [&]() {
+        popped = ring.pop(index);
+        return popped || stopping.load(std::memory_order_relaxed);
+    });
+    return popped;
+}
+
+RandomJson& RandomJsonProducer::next()
+{
+    if (consumed != SIZE_MAX) {
+        push(recycled, recycled_pushed, consumed);
+    }
+    pop(generated, generated_pushed, consumed);
+    return *documents[consumed];
+}
+
+void RandomJsonProducer::produce()
+{
+    Settings document_settings = settings;
+    for (uint64_t n = 0; !stopping.load(std::memory_order_relaxed); n++) {
+        size_t document;
+        if (!pop(recycled, recycled_pushed, document)) {
+            return;
+        }
+        document_settings.generation_seed = settings.generation_seed + n;
+        document_settings.mutation_seed = settings.mutation_seed + n;
+        if (documents[document] == nullptr) {
+            documents[document].reset(new RandomJson(document_settings));
+        }
+        else {
+            documents[document]->load_settings(document_settings);
+        }
+        push(generated, generated_pushed, document);
+    }
+}
+
+// Many documents generated one after the other in a single buffer (an arena), with a single allocation.
+// The i-th document uses the settings with the i-th size, and the seeds of the settings plus i.
+// Each document starts at a multiple of settings.alignment, and it is followed by settings.padding zeroed bytes.
+// The documents are generated by settings.threads threads (0 uses every core), each document by a single thread.
+// The corpus doesn't depend on the number of threads. settings.filepath and settings.output_filepath are ignored.
+class JsonCorpus {
+    public:
+    JsonCorpus(const Settings& settings, const std::vector<int64_t>& sizes);
+    // The sizes are drawn uniformly between min_size and max_size (included), from the generation seed
+    JsonCorpus(const Settings& settings, size_t number_of_documents, int64_t min_size, int64_t max_size);
+    ~JsonCorpus();
+
+    size_t get_number_of_documents() { return sizes.size(); }
+    const char* get_json(size_t i) { return &arena[offsets[i]]; }
+    int64_t get_size(size_t i) { return sizes[i]; }
+    // Offset of each document in the arena
+    const std::vector<int64_t>& get_offsets() { return offsets; }
+    const std::vector<int64_t>& get_sizes() { return sizes; }
+    const char* get_arena() { return arena; }
+    int64_t get_arena_size() { return arena_size; }
+
+    JsonCorpus(const JsonCorpus&) = delete;
+    JsonCorpus& operator=(const JsonCorpus&) = delete;
+
+    private:
+    void generate();
+
+    Settings settings;
+    std::vector<int64_t> sizes;
+    std::vector<int64_t> offsets;
+    char* allocation = nullptr;
+    char* arena = nullptr;
+    int64_t arena_size = 0;
+};
+
+JsonCorpus::JsonCorpus(const Settings& settings, const std::vector<int64_t>& sizes)
+: settings(settings)
+, sizes(sizes)
+{
+    generate();
+}
+
+JsonCorpus::JsonCorpus(const Settings& settings, size_t number_of_documents, int64_t min_size, int64_t max_size)
+: settings(settings)
+, sizes(number_of_documents)
+{
+    // A stream of its own, so the sizes are not correlated to the first document
+    RandomEngine random_generator;
+    random_generator.seed(settings.generation_seed, UINT64_MAX);
+    for (int64_t& size : sizes) {
+        size = random_generator.next_ranged_int64(min_size, max_size);
+    }
+    generate();
+}
+
+JsonCorpus::~JsonCorpus()
+{
+    delete[] allocation;
+}
+
+void JsonCorpus::generate()
+{
+    const int64_t alignment = std::max<int64_t>(settings.alignment, 1);
+    offsets.resize(sizes.size());
+    int64_t offset = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        offsets[i] = offset;
+        offset += sizes[i] + settings.padding;
+        offset = (offset + alignment - 1) / alignment * alignment;
+    }
+    arena_size = offset;
+    allocation = new char[arena_size + alignment - 1];
+    arena = allocation + (alignment - reinterpret_cast<uintptr_t>(allocation) % alignment) % alignment;
+
+    std::atomic<size_t> next_document(0);
+    auto worker = [&]() {
+        // Each thread reuses a single RandomJson, and its own copy of the settings
+        std::unique_ptr<RandomJson> random_json;
+        Settings document_settings = settings;
+        document_settings.filepath = "";
+        document_settings.output_filepath = "";
+        document_settings.threads = 1;
+        size_t i;
+        while ((i = next_document++) < sizes.size()) {
+            document_settings.size = sizes[i];
+            document_settings.generation_seed = settings.generation_seed + i;
+            document_settings.mutation_seed = settings.mutation_seed + i;
+            const int64_t capacity = sizes[i] + settings.padding;
+            if (random_json == nullptr) {
+                random_json.reset(new RandomJson(document_settings, &arena[offsets[i]], capacity));
+            }
+            else {
+                random_json->load_settings(document_settings, &arena[offsets[i]], capacity);
+            }
+        }
+    };
+    int64_t threads = settings.threads == 0 ? std::thread::hardware_concurrency() : settings.threads;
+    threads = std::max<int64_t>(std::min<int64_t>(threads, sizes.size()), 1);
+    std::vector<std::thread> pool;
+    for (int64_t t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : pool) {
+        thread.join();
+    }
+}
+
+// Returns true if a document still makes the parser fail. It is called by several threads at once.
+typedef std::function<bool(const char* json, size_t size)> FailurePredicate;
+
+// Finds the entries of the containers of a document, even an invalid one, with the comma that separates them.
+// Each span is the range of bytes [first, second) that can be removed without touching the other entries.
+void removable_spans(const std::string& json, std::vector<std::pair<size_t, size_t> >& spans)
+{
+    spans.clear();
+    // start of the current entry and position of the comma preceding it (or npos) of each open container
+    std::vector<std::pair<size_t, size_t> > entries;
+    bool in_string = false;
+    for (size_t i = 0; i < json.size(); i++) {
+        const char c = json[i];
+        if (in_string) {
+            if (c == '\\') {
+                i++;
+            }
+            else if (c == '"') {
+                in_string = false;
+            }
+            continue;
+        }
+        switch (c) {
+        case '"':
+            in_string = true;
+            break;
+        case '[': case '{':
+            entries.push_back(std::make_pair(i+1, std::string::npos));
+            break;
+        case ',':
+            if (!entries.empty()) {
+                // The entry goes with the comma following it
+                spans.push_back(std::make_pair(entries.back().first, i+1));
+                entries.back() = std::make_pair(i+1, i);
+            }
+            break;
+        case ']': case '}':
+            if (!entries.empty()) {
+                // The last entry goes with the comma preceding it, if any
+                const size_t first = (entries.back().second != std::string::npos) ? entries.back().second : entries.back().first;
+                if (first < i) {
+                    spans.push_back(std::make_pair(first, i));
+                }
+                entries.pop_back();
+            }
+            break;
+        }
+    }
+    // The biggest first, then in the order of the document
+    std::stable_sort(spans.begin(), spans.end(), [](const std::pair<size_t, size_t>& a, const std::pair<size_t, size_t>& b) {
+        return a.second - a.first > b.second - b.first;
+    });
+}
+
+// Index of the first candidate (from first) that still fails, or -1.
+// The candidates are built and tested by batches, in parallel. A batch is twice as big as the previous one,
+// up to threads candidates, so few candidates are tested for nothing when one of the first ones fails.
+// The result doesn't depend on the number of threads.
+int64_t first_failing_candidate(size_t first, size_t count, const std::function<void(size_t, std::string&)>& build_candidate,
+                                const FailurePredicate& fails, unsigned int threads)
+{
+    std::vector<std::string> candidates(threads);
+    std::vector<char> results(threads);
+    size_t batch_size = 1;
+    for (size_t batch = first; batch < count; batch += batch_size, batch_size = std::min<size_t>(2*batch_size, threads)) {
+        batch_size = std::min(batch_size, count - batch);
+        auto test = [&](size_t i) {
+            build_candidate(batch + i, candidates[i]);
+            results[i] = fails(candidates[i].data(), candidates[i].size());
+        };
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < batch_size; i++) {
+            pool.emplace_back(test, i);
+        }
+        test(0);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+        for (size_t i = 0; i < batch_size; i++) {
+            if (results[i]) {
+                return batch + i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Shrinks a failing document to a smaller document that still fails (fails() returns true).
+// The entries of the containers are removed first, the biggest first, then the remaining bytes, by chunks of
+// decreasing sizes (delta debugging). Each removal is kept if the document still fails.
+// The candidates are tested by threads threads (0 uses every core), and the result doesn't depend on their number.
+// If the document doesn't fail, it is returned as is.
+std::string minimize(const char* json, size_t size, const FailurePredicate& fails, unsigned int threads = 0)
+{
+    std::string document(json, size);
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (!fails(document.data(), document.size())) {
+        return document;
+    }
+
+    // Removing entries. After a removal, the spans are found again and the search goes on from the same rank.
+    // The spans before it are tried again once nothing else can be removed.
+    std::vector<std::pair<size_t, size_t> > spans;
+    size_t rank = 0;
+    while (true) {
+        removable_spans(document, spans);
+        auto without_span = [&](size_t i, std::string& candidate) {
+            candidate.assign(document, 0, spans[i].first);
+            candidate.append(document, spans[i].second, std::string::npos);
+        };
+        int64_t failing = first_failing_candidate(std::min(rank, spans.size()), spans.size(), without_span, fails, threads);
+        if (failing == -1 && rank != 0) {
+            failing = first_failing_candidate(0, std::min(rank, spans.size()), without_span, fails, threads);
+        }
+        if (failing == -1) {
+            break;
+        }
+        document.erase(spans[failing].first, spans[failing].second - spans[failing].first);
+        rank = failing;
+    }
+
+    // Removing bytes
+    for (size_t chunk_size = document.size() / 2; chunk_size > 0; chunk_size /= 2) {
+        size_t chunk = 0;
+        while (true) {
+            const size_t chunks = (document.size() + chunk_size - 1) / chunk_size;
+            auto without_chunk = [&](size_t i, std::string& candidate) {
+                candidate.assign(document, 0, i * chunk_size);
+                candidate.append(document, std::min(document.size(), (i+1) * chunk_size), std::string::npos);
+            };
+            const int64_t failing = first_failing_candidate(chunk, chunks, without_chunk, fails, threads);
+            if (failing == -1) {
+                break;
+            }
+            document.erase(failing * chunk_size, chunk_size);
+            chunk = failing;
+        }
+    }
+    return document;
+}
+
 }
 
 #endif
\ No newline at end of file
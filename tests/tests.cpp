@@ -1,4 +1,6 @@
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include "randomjson.h"
 #include "simdjson.h"
@@ -9,32 +11,640 @@ void test_utf8(const char* json, int size) {
     assert(validate_utf8_fast(json, size));
 }
 
-void test_parse_simdjson(const char* json, int size) {
+int parse_simdjson(const char* json, int size) {
     simdjson::ParsedJson pj;
     bool allocation_is_successful = pj.allocate_capacity(size);
     assert(allocation_is_successful);
-    const int res = simdjson::json_parse(json, size, pj);
+    // The documents are generated with the padding simdjson needs, so there is no copy
+    const bool realloc_if_needed = false;
+    return simdjson::json_parse(json, size, pj, realloc_if_needed);
+}
+
+void test_parse_simdjson(const char* json, int size) {
+    const int res = parse_simdjson(json, size);
     if (res != simdjson::SUCCESS) {
         std::cout << "simdjson error: " << res << std::endl;
     }
     assert(res == simdjson::SUCCESS);
 }
 
+void test_streaming(const randomjson::Settings& settings, randomjson::RandomJson& random_json) {
+    // Small chunks, so the document goes through the window many times
+    const size_t chunk_size = 64;
+    std::ostringstream stream;
+    randomjson::RandomJson streamed_json(settings, randomjson::ostream_sink(stream), chunk_size);
+    assert(stream.str() == std::string(random_json.get_json(), random_json.get_size()));
+}
+
+void test_random_engine() {
+    for (uint64_t stream : {0, 1, 12345}) {
+        randomjson::RandomEngine engine;
+        engine.seed(42, stream);
+        randomjson::RandomEngine skipped = engine;
+        // skip(n) is the same as n calls to next()
+        for (int i = 0; i < 1000; i++) {
+            engine.next();
+        }
+        skipped.skip(1000);
+        assert(skipped.position() == 1000 && engine.position() == 1000);
+        assert(skipped.next() == engine.next());
+        // seek(position()) comes back to the same draws
+        const uint64_t position = engine.position();
+        const uint64_t draw = engine.next();
+        engine.next();
+        engine.seek(position);
+        assert(engine.position() == position && engine.next() == draw);
+        // fill() is the same as repeated calls to next(), including the odd tail
+        uint64_t filled[37];
+        engine.fill(filled, 37);
+        skipped.seek(position + 1);
+        for (uint64_t value : filled) {
+            assert(value == skipped.next());
+        }
+        assert(engine.position() == skipped.position());
+        // Another stream with the same seed gives other draws
+        randomjson::RandomEngine other_stream;
+        other_stream.seed(42, stream + 1);
+        engine.seek(0);
+        for (int i = 0; i < 1000; i++) {
+            assert(engine.next() != other_stream.next());
+        }
+    }
+}
+
+void test_codepoint_sampler() {
+    // The documented ranges, written again so a wrong bound in the header is caught
+    const uint32_t ranges[randomjson::number_of_unicode_ranges][2] = {
+        {0x80, 0xFF}, {0x100, 0x36F}, {0x370, 0x52F}, {0x530, 0x7FF}, {0x800, 0x2FFF}, {0x3000, 0x4DBF}, {0x4E00, 0x9FFF},
+        {0xA000, 0xABFF}, {0xAC00, 0xD7FF}, {0xE000, 0xFFFF}, {0x10000, 0x1FFFF}, {0x20000, 0x3FFFF}, {0x40000, 0x10FFFF}
+    };
+    randomjson::RandomEngine random_generator;
+    random_generator.seed(7);
+    randomjson::CodepointSampler sampler;
+    // Each range alone
+    for (int range = 0; range < randomjson::number_of_unicode_ranges; range++) {
+        randomjson::UnicodeWeights weights = randomjson::UnicodeWeights();
+        weights[range] = 1;
+        sampler.load(weights);
+        for (int i = 0; i < 10000; i++) {
+            const uint32_t codepoint = sampler.next(random_generator);
+            assert(ranges[range][0] <= codepoint && codepoint <= ranges[range][1]);
+        }
+    }
+    // Every range at once: no surrogate, and every range is drawn
+    randomjson::UnicodeWeights weights;
+    weights.fill(1);
+    sampler.load(weights);
+    bool drawn[randomjson::number_of_unicode_ranges] = {false};
+    for (int i = 0; i < 100000; i++) {
+        const uint32_t codepoint = sampler.next(random_generator);
+        assert(codepoint < 0xD800 || codepoint > 0xDFFF);
+        int range = 0;
+        while (range < randomjson::number_of_unicode_ranges && codepoint > ranges[range][1]) {
+            range++;
+        }
+        assert(range < randomjson::number_of_unicode_ranges && codepoint >= ranges[range][0]);
+        drawn[range] = true;
+    }
+    for (bool range_drawn : drawn) {
+        assert(range_drawn);
+    }
+}
+
+void test_sink_errors(int64_t size) {
+    randomjson::Settings settings(size);
+    std::ostringstream stream;
+    randomjson::RandomJson random_json(settings, randomjson::ostream_sink(stream), 64);
+    std::cout << "sink errors seed " << random_json.get_generation_seed() << std::endl;
+    // The next documents are streamed the same way
+    std::ostringstream again;
+    assert(random_json.stream(settings, randomjson::ostream_sink(again), 64));
+    assert(again.str() == stream.str());
+    // A failed sink doesn't get the following chunks
+    int chunks = 0;
+    assert(!random_json.stream(settings, [&chunks](const char*, size_t) { return ++chunks < 3; }, 64));
+    assert(chunks == 3);
+    std::ostringstream broken;
+    broken.setstate(std::ios::badbit);
+    assert(!random_json.stream(settings, randomjson::ostream_sink(broken), 64));
+#if defined(__unix__) || defined(__APPLE__)
+    assert(!random_json.stream(settings, randomjson::fd_sink(-1), 64));
+#endif
+    randomjson::RandomJson in_memory(settings);
+    assert(!in_memory.save("no_such_directory/test.json"));
+}
+
+void test_subtrees(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.padding = SIMDJSON_PADDING;
+    settings.subtree_size = size / 16;
+    randomjson::RandomJson single_thread(settings);
+    settings.threads = 4;
+    randomjson::RandomJson multiple_threads(settings);
+    std::cout << "subtrees seed " << single_thread.get_generation_seed() << std::endl;
+    // The number of threads must not change the document
+    assert(std::string(single_thread.get_json(), single_thread.get_size()) == std::string(multiple_threads.get_json(), multiple_threads.get_size()));
+    test_utf8(multiple_threads.get_json(), multiple_threads.get_size());
+    test_parse_simdjson(multiple_threads.get_json(), multiple_threads.get_size());
+}
+
+void test_structural_index(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.structural_index = true;
+    randomjson::RandomJson random_json(settings);
+    const char* json = random_json.get_json();
+    const randomjson::StructuralIndex& index = random_json.get_structural_index();
+    std::cout << "structural index seed " << random_json.get_generation_seed() << std::endl;
+    for (size_t i = 0; i < index.size(); i++) {
+        const char first = json[index.offsets[i]];
+        const char last = json[index.offsets[i] + index.lengths[i] - 1];
+        switch (index.types[i]) {
+        case randomjson::structural_object:
+            assert(first == '{' && last == '}');
+            break;
+        case randomjson::structural_array:
+            assert(first == '[' && last == ']');
+            break;
+        case randomjson::structural_key:
+        case randomjson::structural_string:
+            assert(first == '"' && last == '"');
+            break;
+        case randomjson::structural_number:
+            assert(first == '-' || (first >= '0' && first <= '9'));
+            break;
+        default:
+            assert(first == 't' || first == 'f' || first == 'n');
+        }
+    }
+}
+
+void test_value_mutations(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.padding = SIMDJSON_PADDING;
+    settings.mutation_weights = {{0, 1}};
+    settings.number_of_mutations = 1000;
+    randomjson::RandomJson random_json(settings);
+    std::cout << "value mutations seeds " << random_json.get_generation_seed() << " " << random_json.get_mutation_seed() << std::endl;
+    // The document stays valid
+    test_utf8(random_json.get_json(), random_json.get_size());
+    test_parse_simdjson(random_json.get_json(), random_json.get_size());
+
+    // The new values are valid and within the limits, even when the generated ones aren't
+    settings.max_string_size = 16;
+    settings.chances_over_max_string_size = 1;
+    settings.chances_over_max_number_size = 1;
+    settings.chances_invalid_string = 1;
+    settings.chances_invalid_number = 1;
+    randomjson::RandomJson mutated_json(settings);
+    settings.number_of_mutations = 0;
+    randomjson::RandomJson faulty_json(settings);
+    const randomjson::StructuralIndex& index = mutated_json.get_structural_index();
+    int mutated_values = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+        const std::string value(mutated_json.get_json() + index.offsets[i], index.lengths[i]);
+        if (index.types[i] < randomjson::structural_string || value == std::string(faulty_json.get_json() + index.offsets[i], index.lengths[i])) {
+            continue;
+        }
+        mutated_values++;
+        assert(index.types[i] != randomjson::structural_string || value.size() <= 16);
+        assert(index.types[i] != randomjson::structural_number || value.size() <= 32);
+        std::string array = "[" + value + "]";
+        const int array_size = static_cast<int>(array.size());
+        array.resize(array_size + SIMDJSON_PADDING);
+        test_parse_simdjson(array.data(), array_size);
+    }
+    assert(mutated_values > 0);
+}
+
+void test_token_mutations(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.mutation_weights = {{0, 0, 1, 1, 1, 1, 1, 1, 1}};
+    randomjson::RandomJson random_json(settings);
+    const std::string original(random_json.get_json(), random_json.get_size());
+    std::cout << "token mutations seeds " << random_json.get_generation_seed() << " " << random_json.get_mutation_seed() << std::endl;
+    for (int i = 0; i < 1000; i++) {
+        random_json.mutate();
+        random_json.reverse_mutation();
+    }
+    assert(original == std::string(random_json.get_json(), random_json.get_size()));
+    // A duplicate comma only takes the place of a whitespace
+    settings.mutation_weights = randomjson::MutationWeights();
+    settings.mutation_weights[randomjson::duplicate_comma] = 1;
+    settings.number_of_mutations = 100;
+    randomjson::RandomJson comma_json(settings);
+    for (int64_t i = 0; i < comma_json.get_size(); i++) {
+        if (comma_json.get_json()[i] != original[i]) {
+            assert(comma_json.get_json()[i] == ',' && std::string(" \t\n\r").find(original[i]) != std::string::npos);
+        }
+    }
+}
+
+void test_extra_exponent_sign(int64_t size) {
+    // Every document with an exponent is invalid after the mutation (the numbers are the only values with an 'e')
+    randomjson::Settings settings = randomjson::workload_settings(randomjson::float_heavy_workload, size);
+    settings.padding = SIMDJSON_PADDING;
+    settings.mutation_weights = randomjson::MutationWeights();
+    settings.mutation_weights[randomjson::extra_exponent_sign] = 1;
+    for (int i = 0; i < 300; i++) {
+        settings.generation_seed = i;
+        settings.mutation_seed = i;
+        randomjson::RandomJson random_json(settings);
+        const std::string original(random_json.get_json(), random_json.get_size());
+        // The signs need two digits, or a sign and a digit
+        auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+        bool has_room = false;
+        for (size_t e = original.find_first_of("eE"); e != std::string::npos; e = original.find_first_of("eE", e+1)) {
+            has_room = has_room || (e+2 < original.size() && is_digit(original[e+2]) && (is_digit(original[e+1]) || original[e+1] == '+' || original[e+1] == '-'));
+        }
+        if (!has_room) {
+            continue;
+        }
+        random_json.mutate();
+        assert(parse_simdjson(random_json.get_json(), random_json.get_size()) != simdjson::SUCCESS);
+        // Only the exponent changes
+        for (int64_t j = 0; j < random_json.get_size(); j++) {
+            if (random_json.get_json()[j] != original[j]) {
+                assert(is_digit(original[j]) || original[j] == '+' || original[j] == '-');
+            }
+        }
+    }
+}
+
+void test_output_file() {
+    // The file holds the mutated document, whether it is mapped or (when its last page has no room for the padding) saved
+    for (int64_t size : {4000, 4096}) {
+        randomjson::Settings settings(size);
+        settings.padding = 64;
+        settings.number_of_mutations = 10;
+        settings.output_filepath = "output.json";
+        randomjson::RandomJson random_json(settings);
+        std::cout << "output file seeds " << random_json.get_generation_seed() << " " << random_json.get_mutation_seed() << std::endl;
+        std::ifstream file("output.json", std::ios::in | std::ios::binary);
+        const std::string saved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        assert(saved == std::string(random_json.get_json(), random_json.get_size()));
+    }
+}
+
+void test_buffers(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.padding = SIMDJSON_PADDING;
+    settings.number_of_mutations = 10;
+    randomjson::RandomJson random_json(settings);
+    std::cout << "buffers seeds " << random_json.get_generation_seed() << " " << random_json.get_mutation_seed() << std::endl;
+    // Reloaded with more mutations, the document is the same as a new one
+    settings.number_of_mutations = 100;
+    random_json.load_settings(settings);
+    randomjson::RandomJson expected(settings);
+    assert(random_json.get_number_of_mutations() == 100);
+    assert(std::string(random_json.get_json(), random_json.get_size()) == std::string(expected.get_json(), expected.get_size()));
+
+    // The buffer of the caller is used as long as the documents fit in it
+    std::vector<char> buffer(size + SIMDJSON_PADDING);
+    randomjson::RandomJson in_buffer(settings, buffer.data(), buffer.size());
+    assert(in_buffer.get_json() == buffer.data());
+    assert(std::string(in_buffer.get_json(), in_buffer.get_size()) == std::string(expected.get_json(), expected.get_size()));
+    settings.size = size / 2;
+    settings.generation_seed++;
+    in_buffer.load_settings(settings);
+    randomjson::RandomJson smaller(settings);
+    assert(in_buffer.get_json() == buffer.data());
+    assert(std::string(in_buffer.get_json(), in_buffer.get_size()) == std::string(smaller.get_json(), smaller.get_size()));
+
+    // A document that doesn't fit goes in a buffer of its own
+    settings.size = size * 2;
+    in_buffer.load_settings(settings);
+    randomjson::RandomJson larger(settings);
+    assert(in_buffer.get_json() != buffer.data());
+    assert(std::string(in_buffer.get_json(), in_buffer.get_size()) == std::string(larger.get_json(), larger.get_size()));
+    randomjson::RandomJson too_small(settings, buffer.data(), buffer.size());
+    assert(too_small.get_json() != buffer.data());
+    assert(std::string(too_small.get_json(), too_small.get_size()) == std::string(larger.get_json(), larger.get_size()));
+}
+
+void test_checkpoints(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.mutation_weights = {{1, 1, 1, 1, 1, 1, 1, 1, 1}};
+    randomjson::RandomJson random_json(settings);
+    std::cout << "checkpoints seeds " << random_json.get_generation_seed() << " " << random_json.get_mutation_seed() << std::endl;
+    const std::string original(random_json.get_json(), random_json.get_size());
+    const randomjson::RandomJson::Checkpoint base = random_json.checkpoint();
+    for (int i = 0; i < 100; i++) {
+        random_json.mutate();
+    }
+    const std::string mutated(random_json.get_json(), random_json.get_size());
+    const randomjson::RandomJson::Checkpoint last = random_json.checkpoint();
+    random_json.rollback_to(base);
+    assert(original == std::string(random_json.get_json(), random_json.get_size()));
+    random_json.rollback_to(last);
+    assert(mutated == std::string(random_json.get_json(), random_json.get_size()));
+}
+
+void test_skipped_mutations(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.number_of_mutations = 100;
+    randomjson::RandomJson all_mutations(settings);
+    settings.skipped_mutations = {10, 50};
+    randomjson::RandomJson skipped_mutations(settings);
+    std::cout << "skipped mutations seeds " << all_mutations.get_generation_seed() << " " << all_mutations.get_mutation_seed() << std::endl;
+    // The other mutations are the same
+    std::vector<randomjson::MutatedByte> expected;
+    for (const randomjson::MutatedByte& mutated_byte : all_mutations.get_mutations()) {
+        if (mutated_byte.mutation != 10 && mutated_byte.mutation != 50) {
+            expected.push_back(mutated_byte);
+        }
+    }
+    std::vector<randomjson::MutatedByte> mutations = skipped_mutations.get_mutations();
+    assert(mutations.size() == expected.size());
+    for (size_t i = 0; i < mutations.size(); i++) {
+        assert(mutations[i].position == expected[i].position && mutations[i].after == expected[i].after);
+    }
+}
+
+void test_minimize(int64_t size) {
+    randomjson::Settings settings(size);
+    randomjson::RandomJson random_json(settings);
+    std::cout << "minimize seed " << random_json.get_generation_seed() << std::endl;
+    // Fails as long as there is a container
+    auto fails = [](const char* json, size_t size) {
+        return std::string(json, size).find_first_of("[{") != std::string::npos;
+    };
+    const std::string minimal_json = randomjson::minimize(random_json.get_json(), random_json.get_size(), fails, 4);
+    assert(minimal_json == "[" || minimal_json == "{");
+}
+
+void test_corpus() {
+    randomjson::Settings settings(0);
+    settings.padding = SIMDJSON_PADDING;
+    settings.threads = 4;
+    randomjson::JsonCorpus corpus(settings, 100, 1000, 10000);
+    std::cout << "corpus seed " << settings.generation_seed << std::endl;
+    for (size_t i = 0; i < corpus.get_number_of_documents(); i++) {
+        test_utf8(corpus.get_json(i), corpus.get_size(i));
+        test_parse_simdjson(corpus.get_json(i), corpus.get_size(i));
+    }
+}
+
+void test_ndjson(int64_t size) {
+    randomjson::Settings settings(size);
+    settings.padding = SIMDJSON_PADDING;
+    settings.ndjson = true;
+    settings.stray_lines = true;
+    settings.structural_index = true;
+    randomjson::RandomJson random_json(settings);
+    std::cout << "ndjson seed " << random_json.get_generation_seed() << std::endl;
+    const std::vector<int64_t>& offsets = random_json.get_record_offsets();
+    const std::vector<int64_t>& sizes = random_json.get_record_sizes();
+    for (size_t i = 0; i < offsets.size(); i++) {
+        const char* record = random_json.get_json() + offsets[i];
+        assert(record[sizes[i]] == '\n');
+        test_utf8(record, sizes[i]);
+        test_parse_simdjson(record, sizes[i]);
+    }
+    // The streamed records are the same, and they are only kept on demand
+    std::ostringstream stream;
+    randomjson::RandomJson streamed_json(settings, randomjson::ostream_sink(stream), 64);
+    assert(stream.str() == std::string(random_json.get_json(), random_json.get_size()));
+    assert(streamed_json.get_record_offsets().empty());
+    settings.stream_record_offsets = true;
+    assert(streamed_json.stream(settings, randomjson::ostream_sink(stream), 64));
+    assert(streamed_json.get_record_offsets() == offsets && streamed_json.get_record_sizes() == sizes);
+    // Each record is a top-level container of the index
+    const randomjson::StructuralIndex& index = random_json.get_structural_index();
+    size_t record = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index.depths[i] == 0) {
+            assert(record < offsets.size());
+            assert(offsets[record] <= index.offsets[i] && index.offsets[i] + index.lengths[i] <= offsets[record] + sizes[record]);
+            record++;
+        }
+    }
+    assert(record == offsets.size());
+    // The value mutations keep the records valid
+    settings.mutation_weights = {{0, 1}};
+    settings.number_of_mutations = 1000;
+    randomjson::RandomJson mutated_json(settings);
+    for (size_t i = 0; i < offsets.size(); i++) {
+        test_parse_simdjson(mutated_json.get_json() + offsets[i], sizes[i]);
+    }
+    assert(mutated_json.get_structural_index().size() == index.size());
+}
+
+void test_workloads(int64_t size) {
+    for (int workload = randomjson::mixed_workload; workload <= randomjson::wide_flat_array_workload; workload++) {
+        randomjson::Settings settings = randomjson::workload_settings(static_cast<randomjson::Workload>(workload), size);
+        settings.padding = SIMDJSON_PADDING;
+        randomjson::RandomJson random_json(settings);
+        std::cout << "workload " << workload << " seed " << random_json.get_generation_seed() << std::endl;
+        test_utf8(random_json.get_json(), random_json.get_size());
+        test_parse_simdjson(random_json.get_json(), random_json.get_size());
+    }
+}
+
+void test_chances(int64_t size) {
+    // Arrays of integers only
+    randomjson::Settings settings(size);
+    randomjson::set_value_chances(settings, 0, 1, 0, 1, 0);
+    settings.chances_generating_float = 0;
+    settings.structural_index = true;
+    settings.padding = SIMDJSON_PADDING;
+    randomjson::RandomJson random_json(settings);
+    std::cout << "chances seed " << random_json.get_generation_seed() << std::endl;
+    test_parse_simdjson(random_json.get_json(), random_json.get_size());
+    const randomjson::StructuralIndex& index = random_json.get_structural_index();
+    for (size_t i = 0; i < index.size(); i++) {
+        assert(index.types[i] == randomjson::structural_array || index.types[i] == randomjson::structural_number);
+        if (index.types[i] == randomjson::structural_number) {
+            const std::string number(random_json.get_json() + index.offsets[i], index.lengths[i]);
+            assert(number.find_first_of(".eE") == std::string::npos);
+        }
+    }
+}
+
+void test_policies(int64_t size) {
+    // The compact generator writes the same document as the runtime generator with the same limits
+    randomjson::Settings settings(size);
+    settings.max_whitespace_size = 0;
+    settings.max_string_size = 64;
+    settings.max_depth = 64;
+    settings.unicode_weights = randomjson::UnicodeWeights();
+    settings.chances_generating_float = 0;
+    settings.padding = SIMDJSON_PADDING;
+    randomjson::RandomJson random_json(settings);
+    randomjson::BasicRandomJson<randomjson::CompactPolicy> compact_json(settings);
+    std::cout << "policies seed " << compact_json.get_generation_seed() << std::endl;
+    assert(std::string(random_json.get_json(), random_json.get_size()) == std::string(compact_json.get_json(), compact_json.get_size()));
+    test_parse_simdjson(compact_json.get_json(), compact_json.get_size());
+}
+
+void test_profile(int64_t size) {
+    // The profile of a document of integers drives a document of integers
+    randomjson::Settings sample_settings = randomjson::workload_settings(randomjson::integer_heavy_workload, size);
+    randomjson::RandomJson sample(sample_settings);
+    assert(sample.save("sample.json"));
+    randomjson::JsonProfile profile;
+    profile.add_file("sample.json");
+    assert(profile.save("profile.txt"));
+    std::shared_ptr<randomjson::JsonProfile> loaded_profile(new randomjson::JsonProfile);
+    assert(loaded_profile->load("profile.txt"));
+    assert(loaded_profile->values == profile.values && loaded_profile->integers == profile.integers);
+
+    randomjson::Settings settings(size);
+    settings.profile = loaded_profile;
+    settings.structural_index = true;
+    settings.padding = SIMDJSON_PADDING;
+    randomjson::RandomJson random_json(settings);
+    std::cout << "profile seeds " << sample.get_generation_seed() << " " << random_json.get_generation_seed() << std::endl;
+    test_parse_simdjson(random_json.get_json(), random_json.get_size());
+    const randomjson::StructuralIndex& index = random_json.get_structural_index();
+    for (size_t i = 0; i < index.size(); i++) {
+        assert(index.types[i] == randomjson::structural_array || index.types[i] == randomjson::structural_number);
+    }
+}
+
+void test_profile_generation(int64_t size) {
+    // A profile changed in place gives its new keys to the next document
+    const std::string keys[] = {"\"alpha\"", "\"omega\""};
+    std::shared_ptr<randomjson::JsonProfile> profile(new randomjson::JsonProfile);
+    randomjson::Settings settings(size);
+    settings.profile = profile;
+    settings.structural_index = true;
+    std::unique_ptr<randomjson::RandomJson> random_json;
+    for (const std::string& key : keys) {
+        const std::string sample = "{" + key + ": [1, 2]}";
+        *profile = randomjson::JsonProfile();
+        profile->add(sample.data(), sample.size());
+        if (random_json) {
+            random_json->load_settings(settings);
+        }
+        else {
+            random_json.reset(new randomjson::RandomJson(settings));
+            std::cout << "profile generation seed " << random_json->get_generation_seed() << std::endl;
+        }
+        // Without room for a key of the profile, a random one is written
+        const randomjson::StructuralIndex& index = random_json->get_structural_index();
+        int profile_keys = 0;
+        for (size_t i = 0; i < index.size(); i++) {
+            if (index.types[i] == randomjson::structural_key) {
+                const std::string written(random_json->get_json() + index.offsets[i], index.lengths[i]);
+                assert(written != keys[0] || key == keys[0]);
+                profile_keys += (written == key) ? 1 : 0;
+            }
+        }
+        assert(profile_keys > 0);
+    }
+}
+
+void test_faults(int64_t size) {
+    // A single invalid piece is enough to reject a document
+    float randomjson::Settings::* const invalid_chances[] = {
+        &randomjson::Settings::chances_invalid_comma,
+        &randomjson::Settings::chances_invalid_utf8,
+        &randomjson::Settings::chances_invalid_string,
+        &randomjson::Settings::chances_invalid_codepoint,
+        &randomjson::Settings::chances_invalid_number
+    };
+    for (float randomjson::Settings::* chances : invalid_chances) {
+        randomjson::Settings settings(size);
+        settings.padding = SIMDJSON_PADDING;
+        settings.*chances = 1;
+        randomjson::RandomJson random_json(settings);
+        std::cout << "faults seed " << random_json.get_generation_seed() << std::endl;
+        assert(parse_simdjson(random_json.get_json(), random_json.get_size()) != simdjson::SUCCESS);
+    }
+
+    // Every limit is exceeded somewhere
+    randomjson::Settings settings(size);
+    settings.max_whitespace_size = 4;
+    settings.max_string_size = 16;
+    settings.max_depth = 8;
+    settings.max_number_range = 9;
+    settings.chances_have_BOM = 1;
+    settings.chances_over_max_whitespace_size = 1;
+    settings.chances_over_max_string_size = 1;
+    settings.chances_over_max_depth = 1;
+    settings.chances_over_max_number_range = 1;
+    settings.structural_index = true;
+    settings.padding = SIMDJSON_PADDING;
+    randomjson::RandomJson random_json(settings);
+    std::cout << "limits seed " << random_json.get_generation_seed() << std::endl;
+    const std::string json(random_json.get_json(), random_json.get_size());
+    assert(json.compare(0, 3, "\xEF\xBB\xBF") == 0);
+    assert(json.find_first_not_of(" \t\n\r", 3) > 3 + 4); // the first whitespace
+    const randomjson::StructuralIndex& index = random_json.get_structural_index();
+    int64_t longest_string = 0;
+    int largest_exponent = 0;
+    uint32_t deepest = 0;
+    for (size_t i = 0; i < index.size(); i++) {
+        if (index.types[i] == randomjson::structural_string) {
+            longest_string = std::max(longest_string, index.lengths[i]);
+        }
+        if (index.types[i] == randomjson::structural_number) {
+            const std::string number = json.substr(index.offsets[i], index.lengths[i]);
+            const size_t exponent = number.find_first_of("eE");
+            if (exponent != std::string::npos) {
+                largest_exponent = std::max(largest_exponent, std::abs(std::atoi(number.c_str() + exponent + 1)));
+            }
+        }
+        deepest = std::max(deepest, index.depths[i]);
+    }
+    assert(longest_string > 16 + 2 && largest_exponent > 9 && deepest >= 8);
+
+    randomjson::Settings number_settings(size);
+    number_settings.max_number_size = 8;
+    number_settings.chances_over_max_number_size = 1;
+    number_settings.structural_index = true;
+    randomjson::RandomJson long_numbers(number_settings);
+    std::cout << "long numbers seed " << long_numbers.get_generation_seed() << std::endl;
+    const randomjson::StructuralIndex& numbers_index = long_numbers.get_structural_index();
+    int64_t longest_number = 0;
+    for (size_t i = 0; i < numbers_index.size(); i++) {
+        if (numbers_index.types[i] == randomjson::structural_number) {
+            longest_number = std::max(longest_number, numbers_index.lengths[i]);
+        }
+    }
+    assert(longest_number > 8);
+}
+
 int main(int argc, char** argv) {
     int size = 100;
     if (argc > 1) {
         size = std::stoi(argv[1]);
     }
 
-    // doing multiple tests
+    // doing multiple tests, the next document being generated while the current one is tested
+    randomjson::Settings settings(size);
+    settings.padding = SIMDJSON_PADDING;
+    randomjson::RandomJsonProducer producer(settings);
     for (int i = 0; i < 100; i++)
     {
-        randomjson::Settings settings(size);
-        randomjson::RandomJson random_json(settings);
+        randomjson::RandomJson& random_json = producer.next();
         random_json.save("test.json");
         std::cout << "seed " << random_json.get_generation_seed() << std::endl;
         test_utf8(random_json.get_json(), random_json.get_size());
         test_parse_simdjson(random_json.get_json(), random_json.get_size());
+        settings.generation_seed = random_json.get_generation_seed();
+        test_streaming(settings, random_json);
     }
+    test_random_engine();
+    test_codepoint_sampler();
+    test_sink_errors(10000);
+    test_subtrees(1000000);
+    test_structural_index(100000);
+    test_value_mutations(100000);
+    test_token_mutations(100000);
+    test_extra_exponent_sign(1000);
+    test_checkpoints(100000);
+    test_buffers(100000);
+    test_output_file();
+    test_skipped_mutations(100000);
+    test_minimize(100000);
+    test_corpus();
+    test_ndjson(1000000);
+    test_workloads(1000000);
+    test_chances(100000);
+    test_policies(100000);
+    test_profile(100000);
+    test_profile_generation(10000);
+    test_faults(100000);
     return 0;
 }